@@ -0,0 +1,137 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * Automatic capture gain control.
+ *
+ * Too little gain leaves most of the bit planes without any signal, and too
+ * much gain clips, so extractor yield peaks somewhere in between.  This is a
+ * perturb-and-observe loop: after every AGC_DWELL refills it compares the
+ * yield measured at the current gain against the yield at the previous gain
+ * and keeps moving in whichever direction helped.  When the two are about
+ * the same, higher gain is preferred.  Any measurable clipping forces the
+ * gain down and sets a ceiling that is only retried after a while, so the
+ * loop keeps following temperature and hardware drift without sitting in
+ * the clipping region.
+ */
+#include <limits.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "agc.h"
+
+#define AGC_STEPS 32           /* the control range is walked in this many steps */
+#define AGC_DWELL 4            /* refills measured at a gain before judging it */
+#define AGC_MAX_CLIP 0.0001    /* clipped fraction of samples that forces gain down */
+#define AGC_TOLERANCE 0.02     /* relative yield change that counts as a change */
+#define AGC_CEILING_AGE 64     /* judgements before a clipping ceiling is retried */
+
+static const struct agc_mixer *mixer;
+static long vol_min, vol_max, vol, step;
+static long ceiling = LONG_MAX;
+static unsigned ceiling_age;
+static int direction = 1;
+static unsigned dwell;
+static size_t acc_samples, acc_clipped, acc_in, acc_out;
+static double last_yield = -1.0;
+static double cur_yield, cur_clip;
+static unsigned long adjustments;
+static bool paused;
+
+bool agc_init(const struct agc_mixer *m)
+{
+    if (!m || !m->get_range(&vol_min, &vol_max) || !m->get(&vol)
+        || vol_max <= vol_min) {
+        log_line("automatic gain control unavailable: no usable capture volume\n");
+        return false;
+    }
+    mixer = m;
+    step = MAX((vol_max - vol_min) / AGC_STEPS, 1);
+    log_line("automatic gain control: capture volume %ld in [%ld, %ld]\n",
+             vol, vol_min, vol_max);
+    return true;
+}
+
+bool agc_enabled(void)
+{
+    return mixer != NULL;
+}
+
+static void agc_set(long v)
+{
+    if (v == vol)
+        return;
+    if (!mixer->set(v)) {
+        log_line("agc: failed to set capture volume to %ld\n", v);
+        return;
+    }
+    vol = v;
+    ++adjustments;
+}
+
+void agc_update(size_t samples, size_t clipped, size_t bytes_in, size_t bytes_out)
+{
+    if (!mixer)
+        return;
+    if (mixer->in_use && !mixer->in_use()) {
+        /* The yield is not ours to judge; start over once it is again. */
+        if (!paused)
+            log_line("agc: paused, capture is not using the controlled card\n");
+        paused = true;
+        dwell = 0;
+        acc_samples = acc_clipped = acc_in = acc_out = 0;
+        last_yield = -1.0;
+        return;
+    }
+    if (paused) {
+        log_line("agc: resumed\n");
+        paused = false;
+    }
+
+    acc_samples += samples;
+    acc_clipped += clipped;
+    acc_in += bytes_in;
+    acc_out += bytes_out;
+    if (++dwell < AGC_DWELL)
+        return;
+    dwell = 0;
+    cur_clip = acc_samples ? (double)acc_clipped / (double)acc_samples : 0.0;
+    cur_yield = acc_in ? (double)acc_out / (double)acc_in : 0.0;
+    acc_samples = acc_clipped = acc_in = acc_out = 0;
+
+    /* Someone else may have moved the control. */
+    long hw;
+    if (mixer->get(&hw))
+        vol = hw;
+
+    if (cur_clip > AGC_MAX_CLIP) {
+        ceiling = vol;
+        ceiling_age = 0;
+        last_yield = -1.0;
+        agc_set(MAX(vol - step, vol_min));
+        return;
+    }
+    if (++ceiling_age > AGC_CEILING_AGE)
+        ceiling = LONG_MAX;
+
+    if (last_yield >= 0.0) {
+        if (cur_yield < last_yield * (1.0 - AGC_TOLERANCE))
+            direction = -direction;
+        else if (cur_yield <= last_yield * (1.0 + AGC_TOLERANCE))
+            direction = 1;
+    }
+    last_yield = cur_yield;
+
+    /* Hold at the edges rather than bouncing off of them. */
+    long next = vol + direction * step;
+    if (next < vol_min || next > vol_max || next >= ceiling)
+        return;
+    agc_set(next);
+}
+
+void agc_print_stats(void)
+{
+    if (!mixer)
+        return;
+    log_line("agc: capture volume %ld in [%ld, %ld], yield %f, clip rate %f, %lu adjustments%s\n",
+             vol, vol_min, vol_max, cur_yield, cur_clip, adjustments,
+             paused ? ", paused" : "");
+}
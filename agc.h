@@ -0,0 +1,28 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_AGC_H_
+#define NJK_AGC_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A capture gain control.  The sound backend provides one for real hardware
+ * (see sound_mixer()); anything else that implements these three calls can
+ * stand in for it, which is how the control loop can be exercised without
+ * a sound card.  Each call returns false on failure.  in_use is optional;
+ * when it returns false, capture is not coming through this control (e.g.
+ * the backend has failed over to another card), and the loop is paused.
+ */
+struct agc_mixer {
+    bool (*get_range)(long *min, long *max);
+    bool (*get)(long *vol);
+    bool (*set)(long vol);
+    bool (*in_use)(void);
+};
+
+bool agc_init(const struct agc_mixer *m);
+bool agc_enabled(void);
+void agc_update(size_t samples, size_t clipped, size_t bytes_in, size_t bytes_out);
+void agc_print_stats(void);
+
+#endif
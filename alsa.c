@@ -1,106 +1,373 @@
 // Copyright 2008-2014 Nicholas J. Kain <njkain at gmail dot com>
 // SPDX-License-Identifier: MIT
 #include <stdbool.h>
+#include <stdio.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
 #include "nk/log.h"
 #include "defines.h"
 #include "sound.h"
+#include "agc.h"
+#include "trace.h"
 
 extern bool gflags_debug;
 
-static char *cdevice = DEFAULT_HW_DEVICE;
+/*
+ * Capture devices: the primary, followed by any standbys in the order they
+ * were given.  Every device that is not failed has been opened, configured
+ * exactly like the primary, and warmed up by discarding its first
+ * skip_bytes.  Standbys are then kept running, and paused along with the
+ * active device, and each sound_read() discards what they have captured,
+ * so that when the active device fails, capture moves to the next ready one
+ * within the same call and its first frames are fresh.  The failed device is
+ * closed and a background thread reopens it, backing off exponentially,
+ * after which it becomes a standby itself.
+ *
+ * Only the capture thread touches a ready device and only the reopen thread
+ * touches a failed one; a device changes hands through its state.
+ */
+#define MAX_DEVICES 4
+#define REOPEN_MIN_SECS 1
+#define REOPEN_MAX_SECS 64
+
+enum dev_state {
+    DEV_READY = 0,
+    DEV_FAILED,
+};
+
+struct capture_dev {
+    char *name;
+    snd_pcm_t *pcm;
+    int can_pause;
+    _Atomic int state;
+    unsigned backoff;
+    time_t retry;
+    unsigned long failures;
+};
+
+static struct capture_dev devs[MAX_DEVICES] = {
+    { .name = DEFAULT_HW_DEVICE },
+};
+static size_t ndevs = 1, active;
+static unsigned long failovers;
+
+static pthread_mutex_t reopen_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reopen_cond;
+
 static const char *cdev_id = DEFAULT_HW_ITEM;
 static unsigned int sample_rate = DEFAULT_SAMPLE_RATE;
-static snd_pcm_t *pcm_handle = 0;
 static size_t pcm_bytes_per_frame;
 static int snd_format = -1;
 static unsigned int skip_bytes = DEFAULT_SKIP_BYTES;
-static int pcm_can_pause;
+static snd_pcm_uframes_t period_frames = DEFAULT_PERIOD_FRAMES;
+static snd_pcm_uframes_t buffer_frames = DEFAULT_BUFFER_FRAMES;
+static unsigned long xruns;
+static snd_mixer_t *mixer_handle;
+static snd_mixer_elem_t *mixer_elem;
 
-void sound_open(void)
+/*
+ * Opens and configures a device.  The primary negotiates the rate, format,
+ * and period size; a standby must match them exactly, since the extractor
+ * cannot tell which device a period came from.
+ * @return false, after logging why, if the device is unusable
+ */
+static bool dev_configure(struct capture_dev *d, bool primary)
 {
-    char buf[PAGE_SIZE];
     int err;
     snd_pcm_hw_params_t *ct_params;
+    snd_pcm_sw_params_t *sw_params;
+    unsigned int rate = sample_rate;
+    snd_pcm_uframes_t period = period_frames, buffer = buffer_frames;
 
-    if ((err = snd_pcm_open(&pcm_handle, cdevice, SND_PCM_STREAM_CAPTURE, 0)) < 0)
-        suicide("Error opening PCM device %s: %s\n", cdevice, snd_strerror(err));
+    if ((err = snd_pcm_open(&d->pcm, d->name, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+        log_line("Error opening PCM device %s: %s\n", d->name, snd_strerror(err));
+        d->pcm = (snd_pcm_t *)0;
+        return false;
+    }
 
     snd_pcm_hw_params_alloca(&ct_params);
 
-    err = snd_pcm_hw_params_any(pcm_handle, ct_params);
-    if (err < 0)
-        suicide("Broken configuration for %s PCM: no configurations available: %s\n",
-                   cdev_id, snd_strerror(err));
+    err = snd_pcm_hw_params_any(d->pcm, ct_params);
+    if (err < 0) {
+        log_line("Broken configuration for %s PCM: no configurations available: %s\n",
+                 d->name, snd_strerror(err));
+        goto fail;
+    }
 
     /* Disable rate resampling */
-    err = snd_pcm_hw_params_set_rate_resample(pcm_handle, ct_params, 0);
-    if (err < 0)
-        suicide("Could not disable rate resampling: %s\n", snd_strerror(err));
+    err = snd_pcm_hw_params_set_rate_resample(d->pcm, ct_params, 0);
+    if (err < 0) {
+        log_line("Could not disable rate resampling: %s\n", snd_strerror(err));
+        goto fail;
+    }
 
     /* Set access to SND_PCM_ACCESS_RW_INTERLEAVED -- NONINTERLEAVED would
      * be preferable, but it's uncommon on sound cards.*/
-    err = snd_pcm_hw_params_set_access(pcm_handle, ct_params,
+    err = snd_pcm_hw_params_set_access(d->pcm, ct_params,
                                        SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err < 0)
-        suicide("Could not set access to SND_PCM_ACCESS_RW_INTERLEAVED: %s\n",
-                   snd_strerror(err));
+    if (err < 0) {
+        log_line("Could not set access to SND_PCM_ACCESS_RW_INTERLEAVED: %s\n",
+                 snd_strerror(err));
+        goto fail;
+    }
 
     /* Choose rate nearest to our target rate */
-    err = snd_pcm_hw_params_set_rate_near(pcm_handle, ct_params, &sample_rate, 0);
-    if (err < 0)
-        suicide("Rate %iHz not available for %s: %s\n",
-                   sample_rate, cdev_id, snd_strerror(err));
+    err = snd_pcm_hw_params_set_rate_near(d->pcm, ct_params, &rate, 0);
+    if (err < 0 || (!primary && rate != sample_rate)) {
+        log_line("Rate %iHz not available for %s: %s\n", sample_rate, d->name,
+                 err < 0 ? snd_strerror(err) : "does not match the primary");
+        goto fail;
+    }
 
     /* Set sample format -- prefer endianness equal to that of the CPU */
+    int format = snd_format;
+    if (primary) {
 #ifdef HOST_ENDIAN_BE
-    snd_format = SND_PCM_FORMAT_S16_BE;
+        format = SND_PCM_FORMAT_S16_BE;
 #else
-    snd_format = SND_PCM_FORMAT_S16_LE;
+        format = SND_PCM_FORMAT_S16_LE;
 #endif
-    err = snd_pcm_hw_params_set_format(pcm_handle, ct_params, snd_format);
-    if (err < 0) {
+    }
+    err = snd_pcm_hw_params_set_format(d->pcm, ct_params, format);
+    if (err < 0 && primary) {
 #ifdef HOST_ENDIAN_BE
-        snd_format = SND_PCM_FORMAT_S16_LE;
+        format = SND_PCM_FORMAT_S16_LE;
 #else
-        snd_format = SND_PCM_FORMAT_S16_BE;
+        format = SND_PCM_FORMAT_S16_BE;
 #endif
-        err = snd_pcm_hw_params_set_format(pcm_handle, ct_params, snd_format);
+        err = snd_pcm_hw_params_set_format(d->pcm, ct_params, format);
+    }
+    if (err < 0) {
+        log_line("Sample format (SND_PCM_FORMAT_S16_BE and _LE) not available for %s: %s\n",
+                 d->name, snd_strerror(err));
+        goto fail;
     }
-    if (err < 0)
-        suicide("Sample format (SND_PCM_FORMAT_S16_BE and _LE) not available for %s: %s\n",
-                   cdev_id, snd_strerror(err));
 
     /* Set stereo for faster sampling. */
-    err = snd_pcm_hw_params_set_channels(pcm_handle, ct_params, 2);
-    if (err < 0)
-        suicide("Channels count (%i) not available for %s: %s\n",
-                   2, cdev_id, snd_strerror(err));
+    err = snd_pcm_hw_params_set_channels(d->pcm, ct_params, 2);
+    if (err < 0) {
+        log_line("Channels count (%i) not available for %s: %s\n",
+                 2, d->name, snd_strerror(err));
+        goto fail;
+    }
+
+    /* Size the period so that each read is one large batch, and keep
+     * several periods of headroom in the buffer so that a late wakeup
+     * does not overrun. */
+    err = snd_pcm_hw_params_set_period_size_near(d->pcm, ct_params, &period, 0);
+    if (err < 0) {
+        log_line("Period size (%lu frames) not available for %s: %s\n",
+                 period, d->name, snd_strerror(err));
+        goto fail;
+    }
+    buffer = MAX(buffer, 2 * period);
+    err = snd_pcm_hw_params_set_buffer_size_near(d->pcm, ct_params, &buffer);
+    if (err < 0) {
+        log_line("Buffer size (%lu frames) not available for %s: %s\n",
+                 buffer, d->name, snd_strerror(err));
+        goto fail;
+    }
 
     /* Apply settings to sound device */
-    err = snd_pcm_hw_params(pcm_handle, ct_params);
-    if (err < 0)
-        suicide("Could not apply settings to sound device!\n");
+    err = snd_pcm_hw_params(d->pcm, ct_params);
+    if (err < 0) {
+        log_line("Could not apply settings to sound device %s!\n", d->name);
+        goto fail;
+    }
+
+    snd_pcm_hw_params_get_period_size(ct_params, &period, 0);
+    snd_pcm_hw_params_get_buffer_size(ct_params, &buffer);
+    if (period > MAX_PERIOD_FRAMES) {
+        log_line("Period size (%lu frames) is larger than the maximum of %u frames\n",
+                 period, MAX_PERIOD_FRAMES);
+        goto fail;
+    }
+    if (!primary && period != period_frames) {
+        log_line("Period size (%lu frames) of %s does not match the primary's %lu\n",
+                 period, d->name, period_frames);
+        goto fail;
+    }
+    if (gflags_debug) log_line("%s: period: %lu frames, buffer: %lu frames\n",
+                               d->name, period, buffer);
+
+    /* Only wake up once a whole period is ready to be read. */
+    snd_pcm_sw_params_alloca(&sw_params);
+    err = snd_pcm_sw_params_current(d->pcm, sw_params);
+    if (err < 0) {
+        log_line("Could not get software parameters: %s\n", snd_strerror(err));
+        goto fail;
+    }
+    err = snd_pcm_sw_params_set_avail_min(d->pcm, sw_params, period);
+    if (err < 0) {
+        log_line("Could not set avail_min: %s\n", snd_strerror(err));
+        goto fail;
+    }
+    err = snd_pcm_sw_params(d->pcm, sw_params);
+    if (err < 0) {
+        log_line("Could not apply software parameters: %s\n", snd_strerror(err));
+        goto fail;
+    }
 
-    ssize_t tbpf = snd_pcm_frames_to_bytes(pcm_handle, 1);
-    if (tbpf > 0)
+    ssize_t tbpf = snd_pcm_frames_to_bytes(d->pcm, 1);
+    if (tbpf <= 0 || (!primary && (size_t)tbpf != pcm_bytes_per_frame)) {
+        log_line("Unusable bytes-per-frame (%zd) for %s\n", tbpf, d->name);
+        goto fail;
+    }
+    if (primary) {
+        sample_rate = rate;
+        snd_format = format;
+        period_frames = period;
+        buffer_frames = buffer;
         pcm_bytes_per_frame = (size_t)tbpf;
-    else
-        suicide("pcm_bytes_per_frame would be zero or negative!\n");
-    if (gflags_debug) log_line("bytes-per-frame: %zu\n", pcm_bytes_per_frame);
-    pcm_can_pause = snd_pcm_hw_params_can_pause(ct_params);
+        if (gflags_debug) log_line("bytes-per-frame: %zu\n", pcm_bytes_per_frame);
+    }
+    d->can_pause = snd_pcm_hw_params_can_pause(ct_params);
+    return true;
+fail:
+    snd_pcm_close(d->pcm);
+    d->pcm = (snd_pcm_t *)0;
+    return false;
+}
 
-    /* Discard the initial data; it may be a click or something else odd. */
+/* Discards the initial data; it may be a click or something else odd. */
+static bool dev_warm_up(struct capture_dev *d)
+{
+    char buf[PAGE_SIZE];
     size_t got_bytes = 0;
-    while (got_bytes < skip_bytes)
-        got_bytes += sound_read(buf, sizeof buf);
-    log_line("discarded first %zu bytes of pcm input\n", got_bytes);
 
-    if (pcm_can_pause) {
+    while (got_bytes < skip_bytes) {
+        snd_pcm_sframes_t fr = snd_pcm_readi(d->pcm, buf, sizeof buf / pcm_bytes_per_frame);
+        if (fr == -EINTR || fr == -EAGAIN)
+            continue;
+        if (fr < 0) {
+            int err = snd_pcm_recover(d->pcm, (int)fr, 1);
+            if (err < 0) {
+                log_line("%s failed while warming up: %s\n", d->name, snd_strerror(err));
+                return false;
+            }
+            continue;
+        }
+        got_bytes += (size_t)fr * pcm_bytes_per_frame;
+    }
+    log_line("discarded first %zu bytes of pcm input from %s\n", got_bytes, d->name);
+    return true;
+}
+
+/* Opens a standby and leaves it running after the warm-up. */
+static bool standby_open(struct capture_dev *d)
+{
+    if (!dev_configure(d, false))
+        return false;
+    if (!dev_warm_up(d)) {
+        snd_pcm_close(d->pcm);
+        d->pcm = (snd_pcm_t *)0;
+        return false;
+    }
+    return true;
+}
+
+static time_t monotonic_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Hands a device that could not be opened, or has failed, to the reopen thread. */
+static void dev_schedule_reopen(struct capture_dev *d, unsigned backoff)
+{
+    pthread_mutex_lock(&reopen_lock);
+    d->backoff = backoff;
+    d->retry = monotonic_secs() + backoff;
+    atomic_store_explicit(&d->state, DEV_FAILED, memory_order_release);
+    pthread_cond_signal(&reopen_cond);
+    pthread_mutex_unlock(&reopen_lock);
+}
+
+static void *reopen_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&reopen_lock);
+    for (;;) {
+        time_t now = monotonic_secs(), next = 0;
+        for (size_t i = 0; i < ndevs; ++i) {
+            struct capture_dev *d = &devs[i];
+            if (atomic_load_explicit(&d->state, memory_order_acquire) != DEV_FAILED)
+                continue;
+            if (d->retry <= now) {
+                pthread_mutex_unlock(&reopen_lock);
+                bool ok = standby_open(d);
+                pthread_mutex_lock(&reopen_lock);
+                now = monotonic_secs();
+                if (ok) {
+                    log_line("capture device %s reopened as a standby\n", d->name);
+                    atomic_store_explicit(&d->state, DEV_READY, memory_order_release);
+                    continue;
+                }
+                d->backoff = MIN(2 * d->backoff, REOPEN_MAX_SECS);
+                d->retry = now + d->backoff;
+                if (gflags_debug) log_line("retrying %s in %us\n", d->name, d->backoff);
+            }
+            if (!next || d->retry < next)
+                next = d->retry;
+        }
+        if (!next) {
+            pthread_cond_wait(&reopen_cond, &reopen_lock);
+        } else {
+            struct timespec ts = { .tv_sec = next };
+            pthread_cond_timedwait(&reopen_cond, &reopen_lock, &ts);
+        }
+    }
+    return NULL;
+}
+
+static void reopen_thread_start(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reopen_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* Signals are always handled by the main thread. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t tid;
+    int r = pthread_create(&tid, NULL, reopen_thread, NULL);
+    if (r)
+        suicide("pthread_create failed: %s\n", strerror(r));
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void sound_open(void)
+{
+    struct capture_dev *d = &devs[0];
+
+    if (!dev_configure(d, true) || !dev_warm_up(d))
+        suicide("Could not open capture device %s\n", d->name);
+
+    if (d->can_pause) {
         sound_stop();
         if (gflags_debug) log_line("alsa device supports pcm pause\n");
     }
+
+    if (ndevs < 2)
+        return;
+    reopen_thread_start();
+    for (size_t i = 1; i < ndevs; ++i) {
+        if (standby_open(&devs[i]))
+            log_line("capture device %s is on standby\n", devs[i].name);
+        else
+            dev_schedule_reopen(&devs[i], REOPEN_MIN_SECS);
+    }
 }
 
 size_t sound_bytes_per_frame(void)
@@ -108,36 +375,255 @@ size_t sound_bytes_per_frame(void)
     return pcm_bytes_per_frame;
 }
 
+size_t sound_period_frames(void)
+{
+    return period_frames;
+}
+
+unsigned sound_sample_rate(void)
+{
+    return sample_rate;
+}
+
+/*
+ * Moves capture from the failed active device to the next ready standby.
+ * The caller sees the switch via sound_failovers(), so that it does not pair
+ * frames from the two devices with each other.
+ * @return false if there is no ready standby
+ */
+static bool failover(int err)
+{
+    struct capture_dev *d = &devs[active];
+
+    log_line("capture device %s failed: %s\n", d->name, snd_strerror(err));
+    ++d->failures;
+    if (ndevs < 2)
+        return false;
+    snd_pcm_close(d->pcm);
+    d->pcm = (snd_pcm_t *)0;
+    dev_schedule_reopen(d, REOPEN_MIN_SECS);
+
+    for (size_t k = 1; k < ndevs; ++k) {
+        size_t i = (active + k) % ndevs;
+        if (atomic_load_explicit(&devs[i].state, memory_order_acquire) != DEV_READY)
+            continue;
+        active = i;
+        ++failovers;
+        trace_event(TRACE_FAILOVER, (uint32_t)i, (uint32_t)failovers, 0, 0);
+        log_line("capture switched to %s\n", devs[i].name);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Discards what a running standby has captured, so that it neither overruns
+ * nor hands stale frames to a failover.  A standby that cannot be kept
+ * running goes to the reopen thread.
+ */
+static void standby_drain(struct capture_dev *d)
+{
+    snd_pcm_sframes_t fr = snd_pcm_avail_update(d->pcm);
+    if (fr > 0)
+        fr = snd_pcm_forward(d->pcm, (snd_pcm_uframes_t)fr);
+    if (fr >= 0)
+        return;
+    if ((fr == -EPIPE || fr == -ESTRPIPE)
+        && snd_pcm_recover(d->pcm, (int)fr, 1) >= 0 && snd_pcm_start(d->pcm) >= 0)
+        return;
+    log_line("standby capture device %s failed: %s\n", d->name, snd_strerror((int)fr));
+    ++d->failures;
+    snd_pcm_close(d->pcm);
+    d->pcm = (snd_pcm_t *)0;
+    dev_schedule_reopen(d, REOPEN_MIN_SECS);
+}
+
+static void standbys_drain(void)
+{
+    for (size_t i = 0; i < ndevs; ++i) {
+        if (i != active
+            && atomic_load_explicit(&devs[i].state, memory_order_acquire) == DEV_READY)
+            standby_drain(&devs[i]);
+    }
+}
+
+/*
+ * Returns the number of frames read.  Zero is returned after an overrun,
+ * suspend, or failover; the caller can detect that case via sound_xruns()
+ * and sound_failovers() and should not treat the frames on either side of
+ * the gap as contiguous.
+ */
 unsigned sound_read(void *buf, size_t size)
 {
+    struct capture_dev *d = &devs[active];
     snd_pcm_sframes_t fr;
 
-    fr = snd_pcm_readi(pcm_handle, buf, size / pcm_bytes_per_frame);
-    /* Make sure we aren't hitting a disconnect/suspend case */
-    if (fr < 0)
-        fr = snd_pcm_recover(pcm_handle, fr, 0);
-    /* Nope, something else is wrong. Bail. */
-    if (fr < 0 || (fr == -1 && errno != EINTR))
-        suicide("get_random_data(): Read error: %s\n", strerror(errno));
-    return (unsigned)fr;
+    fr = snd_pcm_readi(d->pcm, buf, size / pcm_bytes_per_frame);
+    if (ndevs > 1)
+        standbys_drain();
+    if (fr >= 0)
+        return (unsigned)fr;
+    if (fr == -EINTR || fr == -EAGAIN)
+        return 0;
+    /* Make sure we aren't hitting an overrun/suspend case */
+    if (fr == -EPIPE || fr == -ESTRPIPE) {
+        ++xruns;
+        if (gflags_debug) log_line("capture xrun (%s); recovering\n",
+                                   snd_strerror((int)fr));
+        int err = snd_pcm_recover(d->pcm, (int)fr, 1);
+        if (err >= 0)
+            return 0;
+        if (failover(err))
+            return 0;
+        suicide("sound_read(): Could not recover from xrun: %s\n",
+                snd_strerror(err));
+    }
+    /* Nope, something else is wrong.  Switch devices or bail. */
+    if (failover((int)fr))
+        return 0;
+    suicide("sound_read(): Read error: %s\n", snd_strerror((int)fr));
+}
+
+/* Frames captured but not yet read; only a hint, so errors count as none. */
+size_t sound_backlog(void)
+{
+    snd_pcm_sframes_t fr = snd_pcm_avail_update(devs[active].pcm);
+    return fr > 0 ? (size_t)fr : 0;
+}
+
+unsigned long sound_xruns(void)
+{
+    return xruns;
+}
+
+unsigned long sound_failovers(void)
+{
+    return failovers;
+}
+
+void sound_print_stats(void)
+{
+    if (ndevs < 2)
+        return;
+    log_line("capture device %s is active; %lu failovers\n", devs[active].name, failovers);
+    for (size_t i = 0; i < ndevs; ++i)
+        log_line("%s: %s, %lu failures\n", devs[i].name,
+                 atomic_load(&devs[i].state) == DEV_READY ? "ready" : "reopening",
+                 devs[i].failures);
+}
+
+/* Ready standbys are paused and resumed along with the active device. */
+static void sound_pause(int enable)
+{
+    for (size_t i = 0; i < ndevs; ++i) {
+        if (i != active
+            && atomic_load_explicit(&devs[i].state, memory_order_acquire) != DEV_READY)
+            continue;
+        if (devs[i].can_pause)
+            snd_pcm_pause(devs[i].pcm, enable);
+    }
 }
 
 void sound_start(void)
 {
-    if (pcm_can_pause)
-        snd_pcm_pause(pcm_handle, 0);
+    sound_pause(0);
 }
 
 void sound_stop(void)
 {
-    if (pcm_can_pause)
-        snd_pcm_pause(pcm_handle, 1);
+    sound_pause(1);
 }
 
 void sound_close(void)
 {
-    snd_pcm_close(pcm_handle);
-    pcm_handle = (snd_pcm_t *)0;
+    for (size_t i = 0; i < ndevs; ++i) {
+        if (atomic_load(&devs[i].state) != DEV_READY || !devs[i].pcm)
+            continue;
+        snd_pcm_close(devs[i].pcm);
+        devs[i].pcm = (snd_pcm_t *)0;
+    }
+    if (mixer_handle) {
+        snd_mixer_close(mixer_handle);
+        mixer_handle = (snd_mixer_t *)0;
+        mixer_elem = (snd_mixer_elem_t *)0;
+    }
+}
+
+static bool alsa_mixer_get_range(long *min, long *max)
+{
+    return snd_mixer_selem_get_capture_volume_range(mixer_elem, min, max) == 0;
+}
+
+static bool alsa_mixer_get(long *vol)
+{
+    snd_mixer_handle_events(mixer_handle);
+    return snd_mixer_selem_get_capture_volume(mixer_elem, SND_MIXER_SCHN_FRONT_LEFT,
+                                              vol) == 0;
+}
+
+static bool alsa_mixer_set(long vol)
+{
+    return snd_mixer_selem_set_capture_volume_all(mixer_elem, vol) == 0;
+}
+
+/* The control belongs to the primary device's card, not to a standby's. */
+static bool alsa_mixer_in_use(void)
+{
+    return active == 0;
+}
+
+static const struct agc_mixer alsa_mixer = {
+    .get_range = alsa_mixer_get_range,
+    .get = alsa_mixer_get,
+    .set = alsa_mixer_set,
+    .in_use = alsa_mixer_in_use,
+};
+
+/*
+ * Returns the capture volume control named by the item (cdev_id) on the card
+ * that holds the primary capture device, or NULL if there is no such
+ * control.  The mixer is opened on first use, so this must be called before
+ * chrooting.
+ */
+const struct agc_mixer *sound_mixer(void)
+{
+    char card[MAX_BUF];
+    int err;
+
+    if (mixer_elem)
+        return &alsa_mixer;
+
+    /* "hw:1,0" and "plughw:1" both live on the control device "hw:1". */
+    const char *p = strchr(devs[0].name, ':');
+    if (!p) {
+        log_line("Cannot tell which card's mixer belongs to %s\n", devs[0].name);
+        return NULL;
+    }
+    snprintf(card, sizeof card, "hw:%.*s", (int)strcspn(p + 1, ","), p + 1);
+
+    if ((err = snd_mixer_open(&mixer_handle, 0)) < 0) {
+        log_line("Error opening mixer: %s\n", snd_strerror(err));
+        return NULL;
+    }
+    if ((err = snd_mixer_attach(mixer_handle, card)) < 0
+        || (err = snd_mixer_selem_register(mixer_handle, NULL, NULL)) < 0
+        || (err = snd_mixer_load(mixer_handle)) < 0) {
+        log_line("Error loading mixer for %s: %s\n", card, snd_strerror(err));
+        goto fail;
+    }
+    for (snd_mixer_elem_t *e = snd_mixer_first_elem(mixer_handle); e;
+         e = snd_mixer_elem_next(e)) {
+        if (snd_mixer_selem_has_capture_volume(e)
+            && !strcasecmp(snd_mixer_selem_get_name(e), cdev_id)) {
+            mixer_elem = e;
+            return &alsa_mixer;
+        }
+    }
+    log_line("No capture volume control named '%s' on %s\n", cdev_id, card);
+fail:
+    snd_mixer_close(mixer_handle);
+    mixer_handle = (snd_mixer_t *)0;
+    return NULL;
 }
 
 int sound_is_le(void)
@@ -156,7 +642,16 @@ int sound_is_be(void)
 
 void sound_set_device(char *str)
 {
-    cdevice = strdup(str);
+    devs[0].name = strdup(str);
+}
+
+void sound_set_standby(char *str)
+{
+    if (ndevs == MAX_DEVICES) {
+        log_line("Too many standby devices; ignoring %s\n", str);
+        return;
+    }
+    devs[ndevs++].name = strdup(str);
 }
 
 void sound_set_port(char *str)
@@ -180,3 +675,19 @@ void sound_set_skip_bytes(int sb)
         skip_bytes = DEFAULT_SKIP_BYTES;
 }
 
+void sound_set_period_size(int frames)
+{
+    if (frames > 0 && frames <= MAX_PERIOD_FRAMES)
+        period_frames = (snd_pcm_uframes_t)frames;
+    else
+        period_frames = DEFAULT_PERIOD_FRAMES;
+}
+
+void sound_set_buffer_size(int frames)
+{
+    if (frames > 0)
+        buffer_frames = (snd_pcm_uframes_t)frames;
+    else
+        buffer_frames = DEFAULT_BUFFER_FRAMES;
+}
+
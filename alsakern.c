@@ -0,0 +1,508 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * ALSA capture straight through the kernel's PCM and control ioctls,
+ * without libasound.  Built instead of alsa.c with
+ * 'make SOUND_BACKEND=alsakern'.
+ *
+ * There is no configuration file parsing and no plugin layer, so the binary
+ * has no sound library dependency at all, can be linked statically, and
+ * starts as soon as the device is open; this makes it usable from an
+ * initramfs.  The price is that only hardware devices are supported: the
+ * device is "hw:CARD" or "hw:CARD,DEVICE", with the card given by number,
+ * or the path of a capture node such as /dev/snd/pcmC0D0c.  The hardware
+ * must natively support 16-bit stereo at the requested rate, since there is
+ * nothing to convert for it.
+ *
+ * Periods are read with SNDRV_PCM_IOCTL_READI_FRAMES, which copies them out
+ * of the kernel's ring in one call, the same as snd_pcm_readi() on a hw
+ * device.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sound/asound.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "sound.h"
+#include "agc.h"
+
+extern bool gflags_debug;
+
+static char *cdevice = DEFAULT_HW_DEVICE;
+static const char *cdev_id = DEFAULT_HW_ITEM;
+static int pcm_fd = -1;
+static int card = -1;
+static bool pcm_can_pause;
+static unsigned int sample_rate = DEFAULT_SAMPLE_RATE;
+static size_t pcm_bytes_per_frame = 2 * sizeof(int16_t);
+static int snd_format = -1;
+static unsigned int skip_bytes = DEFAULT_SKIP_BYTES;
+static unsigned long period_frames = DEFAULT_PERIOD_FRAMES;
+static unsigned long buffer_frames = DEFAULT_BUFFER_FRAMES;
+static unsigned long xruns;
+
+static int ctl_fd = -1;
+static struct snd_ctl_elem_id mixer_id;
+static unsigned int mixer_count;
+static long mixer_min, mixer_max;
+
+static inline struct snd_mask *hw_mask(struct snd_pcm_hw_params *p, int var)
+{
+    return &p->masks[var - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+}
+
+static inline struct snd_interval *hw_interval(struct snd_pcm_hw_params *p, int var)
+{
+    return &p->intervals[var - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+}
+
+/* Every parameter unconstrained, as snd_pcm_hw_params_any() would give. */
+static void hw_any(struct snd_pcm_hw_params *p)
+{
+    memset(p, 0, sizeof *p);
+    for (int v = SNDRV_PCM_HW_PARAM_FIRST_MASK; v <= SNDRV_PCM_HW_PARAM_LAST_MASK; ++v)
+        memset(hw_mask(p, v)->bits, 0xff, sizeof hw_mask(p, v)->bits);
+    for (int v = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL;
+         v <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; ++v) {
+        hw_interval(p, v)->min = 0;
+        hw_interval(p, v)->max = UINT_MAX;
+    }
+    p->rmask = ~0u;
+    p->info = ~0u;
+}
+
+static void hw_set_mask(struct snd_pcm_hw_params *p, int var, unsigned int val)
+{
+    struct snd_mask *m = hw_mask(p, var);
+    memset(m->bits, 0, sizeof m->bits);
+    m->bits[val >> 5] = 1u << (val & 31);
+}
+
+static void hw_set_interval(struct snd_pcm_hw_params *p, int var, unsigned int min,
+                            unsigned int max)
+{
+    struct snd_interval *i = hw_interval(p, var);
+    *i = (struct snd_interval){ .min = min, .max = max, .integer = 1 };
+}
+
+static bool hw_refine(struct snd_pcm_hw_params *p)
+{
+    p->rmask = ~0u;
+    return ioctl(pcm_fd, SNDRV_PCM_IOCTL_HW_REFINE, p) == 0;
+}
+
+/*
+ * Narrows an interval parameter to the value nearest to 'want' that the
+ * hardware allows along with everything chosen so far.
+ * @return false if no value at all is allowed
+ */
+static bool hw_set_near(struct snd_pcm_hw_params *p, int var, unsigned int want)
+{
+    struct snd_pcm_hw_params t = *p;
+
+    hw_set_interval(&t, var, want, want);
+    if (hw_refine(&t)) {
+        *p = t;
+        return true;
+    }
+    if (!hw_refine(p))
+        return false;
+    struct snd_interval *i = hw_interval(p, var);
+    unsigned int v = want < i->min ? i->min : want > i->max ? i->max : want;
+    t = *p;
+    hw_set_interval(&t, var, v, v);
+    if (hw_refine(&t))
+        *p = t;
+    return true;
+}
+
+/* "hw:1", "hw:1,2", or a device node path. */
+static bool parse_device(char *path, size_t len)
+{
+    int dev = 0;
+
+    if (cdevice[0] == '/') {
+        if (sscanf(cdevice, "/dev/snd/pcmC%dD%dc", &card, &dev) != 2)
+            card = -1;
+        snprintf(path, len, "%s", cdevice);
+        return true;
+    }
+    if (sscanf(cdevice, "hw:%d,%d", &card, &dev) < 1 || card < 0 || dev < 0) {
+        log_line("Device %s is not hw:CARD[,DEVICE] or a /dev/snd/pcm*c path; plugins need the alsa backend\n",
+                 cdevice);
+        return false;
+    }
+    snprintf(path, len, "/dev/snd/pcmC%dD%dc", card, dev);
+    return true;
+}
+
+static void pcm_configure(void)
+{
+    struct snd_pcm_hw_params p;
+
+    hw_any(&p);
+    if (!hw_refine(&p))
+        suicide("Broken configuration for %s PCM: no configurations available: %s\n",
+                cdevice, strerror(errno));
+    hw_set_mask(&p, SNDRV_PCM_HW_PARAM_ACCESS, SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+    if (!hw_refine(&p))
+        suicide("Could not set access to RW_INTERLEAVED: %s\n", strerror(errno));
+    hw_set_mask(&p, SNDRV_PCM_HW_PARAM_SUBFORMAT, SNDRV_PCM_SUBFORMAT_STD);
+
+    /* Set sample format -- prefer endianness equal to that of the CPU */
+#ifdef HOST_ENDIAN_BE
+    const int formats[] = { SNDRV_PCM_FORMAT_S16_BE, SNDRV_PCM_FORMAT_S16_LE };
+#else
+    const int formats[] = { SNDRV_PCM_FORMAT_S16_LE, SNDRV_PCM_FORMAT_S16_BE };
+#endif
+    for (size_t i = 0; i < 2 && snd_format < 0; ++i) {
+        struct snd_pcm_hw_params t = p;
+        hw_set_mask(&t, SNDRV_PCM_HW_PARAM_FORMAT, (unsigned)formats[i]);
+        if (hw_refine(&t)) {
+            p = t;
+            snd_format = formats[i];
+        }
+    }
+    if (snd_format < 0)
+        suicide("Sample format (S16_BE and _LE) not available for %s\n", cdevice);
+
+    /* Set stereo for faster sampling. */
+    hw_set_interval(&p, SNDRV_PCM_HW_PARAM_CHANNELS, 2, 2);
+    if (!hw_refine(&p))
+        suicide("Channels count (%i) not available for %s\n", 2, cdevice);
+
+    if (!hw_set_near(&p, SNDRV_PCM_HW_PARAM_RATE, sample_rate))
+        suicide("Rate %iHz not available for %s\n", sample_rate, cdevice);
+    /* Size the period so that each read is one large batch, and keep
+     * several periods of headroom in the buffer so that a late wakeup
+     * does not overrun. */
+    if (!hw_set_near(&p, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, (unsigned)period_frames))
+        suicide("Period size (%lu frames) not available for %s\n", period_frames, cdevice);
+    unsigned long buffer = MAX(buffer_frames,
+                               2 * hw_interval(&p, SNDRV_PCM_HW_PARAM_PERIOD_SIZE)->min);
+    if (!hw_set_near(&p, SNDRV_PCM_HW_PARAM_BUFFER_SIZE, (unsigned)buffer))
+        suicide("Buffer size (%lu frames) not available for %s\n", buffer, cdevice);
+
+    /* The kernel picks a single value for anything still left open. */
+    p.rmask = ~0u;
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_HW_PARAMS, &p) < 0)
+        suicide("Could not apply settings to sound device: %s\n", strerror(errno));
+    sample_rate = hw_interval(&p, SNDRV_PCM_HW_PARAM_RATE)->min;
+    period_frames = hw_interval(&p, SNDRV_PCM_HW_PARAM_PERIOD_SIZE)->min;
+    buffer_frames = hw_interval(&p, SNDRV_PCM_HW_PARAM_BUFFER_SIZE)->min;
+    pcm_can_pause = p.info & SNDRV_PCM_INFO_PAUSE;
+    if (period_frames > MAX_PERIOD_FRAMES)
+        suicide("Period size (%lu frames) is larger than the maximum of %u frames\n",
+                period_frames, MAX_PERIOD_FRAMES);
+    if (gflags_debug) log_line("period: %lu frames, buffer: %lu frames, rate: %uHz\n",
+                               period_frames, buffer_frames, sample_rate);
+
+    /* Start on the first read, and only wake up once a whole period is
+     * ready to be read. */
+    struct snd_pcm_sw_params sw = {
+        .period_step = 1,
+        .avail_min = period_frames,
+        .xfer_align = 1,
+        .start_threshold = 1,
+        .stop_threshold = buffer_frames,
+        .boundary = buffer_frames,
+    };
+    while (sw.boundary * 2 <= LONG_MAX - buffer_frames)
+        sw.boundary *= 2;
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_SW_PARAMS, &sw) < 0)
+        suicide("Could not apply software parameters: %s\n", strerror(errno));
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_PREPARE) < 0)
+        suicide("Could not prepare %s: %s\n", cdevice, strerror(errno));
+}
+
+void sound_open(void)
+{
+    char path[PATH_MAX], buf[PAGE_SIZE];
+    size_t got_bytes = 0;
+
+    if (!parse_device(path, sizeof path))
+        suicide("Could not open capture device %s\n", cdevice);
+    pcm_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (pcm_fd < 0)
+        suicide("Error opening PCM device %s: %s\n", path, strerror(errno));
+    pcm_configure();
+
+    /* Discard the initial data; it may be a click or something else odd. */
+    while (got_bytes < skip_bytes)
+        got_bytes += sound_read(buf, sizeof buf) * pcm_bytes_per_frame;
+    log_line("discarded first %zu bytes of pcm input\n", got_bytes);
+    if (pcm_can_pause) {
+        sound_stop();
+        if (gflags_debug) log_line("alsa device supports pcm pause\n");
+    }
+}
+
+size_t sound_bytes_per_frame(void)
+{
+    return pcm_bytes_per_frame;
+}
+
+size_t sound_period_frames(void)
+{
+    return period_frames;
+}
+
+unsigned sound_sample_rate(void)
+{
+    return sample_rate;
+}
+
+/* Same recovery as snd_pcm_recover(): resume if possible, else re-prepare. */
+static int recover(int err)
+{
+    if (err == ESTRPIPE) {
+        while (ioctl(pcm_fd, SNDRV_PCM_IOCTL_RESUME) < 0 && errno == EAGAIN)
+            usleep(100000);
+    }
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_PREPARE) < 0)
+        return errno;
+    return 0;
+}
+
+/*
+ * Returns the number of frames read.  Zero is returned after an overrun
+ * or suspend; the caller can detect that case via sound_xruns() and should
+ * not treat the frames on either side of the gap as contiguous.
+ */
+unsigned sound_read(void *buf, size_t size)
+{
+    struct snd_xferi x = {
+        .buf = buf,
+        .frames = (snd_pcm_uframes_t)(size / pcm_bytes_per_frame),
+    };
+
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_READI_FRAMES, &x) == 0)
+        return (unsigned)x.result;
+    if (errno == EINTR || errno == EAGAIN)
+        return 0;
+    /* Make sure we aren't hitting an overrun/suspend case */
+    if (errno == EPIPE || errno == ESTRPIPE) {
+        ++xruns;
+        if (gflags_debug) log_line("capture xrun (%s); recovering\n", strerror(errno));
+        int err = recover(errno);
+        if (err)
+            suicide("sound_read(): Could not recover from xrun: %s\n", strerror(err));
+        return 0;
+    }
+    /* Nope, something else is wrong. Bail. */
+    suicide("sound_read(): Read error: %s\n", strerror(errno));
+}
+
+/* Frames captured but not yet read; only a hint, so errors count as none. */
+size_t sound_backlog(void)
+{
+    snd_pcm_sframes_t fr;
+    if (ioctl(pcm_fd, SNDRV_PCM_IOCTL_DELAY, &fr) < 0 || fr < 0)
+        return 0;
+    return (size_t)fr;
+}
+
+unsigned long sound_xruns(void)
+{
+    return xruns;
+}
+
+unsigned long sound_failovers(void)
+{
+    return 0;
+}
+
+void sound_print_stats(void)
+{
+}
+
+void sound_start(void)
+{
+    if (pcm_can_pause)
+        ioctl(pcm_fd, SNDRV_PCM_IOCTL_PAUSE, 0);
+}
+
+void sound_stop(void)
+{
+    if (pcm_can_pause)
+        ioctl(pcm_fd, SNDRV_PCM_IOCTL_PAUSE, 1);
+}
+
+void sound_close(void)
+{
+    if (pcm_fd >= 0) {
+        close(pcm_fd);
+        pcm_fd = -1;
+    }
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        ctl_fd = -1;
+    }
+}
+
+static bool kern_mixer_get_range(long *min, long *max)
+{
+    *min = mixer_min;
+    *max = mixer_max;
+    return true;
+}
+
+static bool kern_mixer_get(long *vol)
+{
+    struct snd_ctl_elem_value v = { .id = mixer_id };
+    if (ioctl(ctl_fd, SNDRV_CTL_IOCTL_ELEM_READ, &v) < 0)
+        return false;
+    *vol = v.value.integer.value[0];
+    return true;
+}
+
+static bool kern_mixer_set(long vol)
+{
+    struct snd_ctl_elem_value v = { .id = mixer_id };
+    for (unsigned i = 0; i < mixer_count; ++i)
+        v.value.integer.value[i] = vol;
+    return ioctl(ctl_fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &v) == 0;
+}
+
+static const struct agc_mixer kern_mixer = {
+    .get_range = kern_mixer_get_range,
+    .get = kern_mixer_get,
+    .set = kern_mixer_set,
+};
+
+/*
+ * Names a control the way the ALSA simple mixer does: "Mic Capture Volume"
+ * is the capture volume of "Mic", and "Capture Volume" that of "Capture".
+ */
+static bool is_capture_volume(const char *name)
+{
+    static const char suffix[] = " Capture Volume";
+    size_t n = strlen(name), sn = sizeof suffix - 1;
+
+    if (!strcasecmp(name, "Capture Volume"))
+        return !strcasecmp(cdev_id, "Capture");
+    return n > sn && !strcasecmp(name + n - sn, suffix)
+        && strlen(cdev_id) == n - sn && !strncasecmp(name, cdev_id, n - sn);
+}
+
+/*
+ * Returns the capture volume control named by the item (cdev_id) on the card
+ * that holds the capture device, or NULL if there is no such control.  The
+ * control device is opened on first use, so this must be called before
+ * chrooting.
+ */
+const struct agc_mixer *sound_mixer(void)
+{
+    char path[64];
+    struct snd_ctl_elem_id ids[64];
+
+    if (ctl_fd >= 0)
+        return &kern_mixer;
+    if (card < 0) {
+        log_line("Cannot tell which card's mixer belongs to %s\n", cdevice);
+        return NULL;
+    }
+    snprintf(path, sizeof path, "/dev/snd/controlC%d", card);
+    ctl_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (ctl_fd < 0) {
+        log_line("Error opening mixer %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct snd_ctl_elem_list list = { .space = 64, .pids = ids };
+    do {
+        if (ioctl(ctl_fd, SNDRV_CTL_IOCTL_ELEM_LIST, &list) < 0) {
+            log_line("Error listing controls on %s: %s\n", path, strerror(errno));
+            break;
+        }
+        for (unsigned i = 0; i < list.used; ++i) {
+            if (ids[i].iface != SNDRV_CTL_ELEM_IFACE_MIXER
+                || !is_capture_volume((const char *)ids[i].name))
+                continue;
+            struct snd_ctl_elem_info info = { .id = ids[i] };
+            if (ioctl(ctl_fd, SNDRV_CTL_IOCTL_ELEM_INFO, &info) < 0
+                || info.type != SNDRV_CTL_ELEM_TYPE_INTEGER
+                || !info.count || info.count > 128)
+                continue;
+            mixer_id = info.id;
+            mixer_count = info.count;
+            mixer_min = info.value.integer.min;
+            mixer_max = info.value.integer.max;
+            return &kern_mixer;
+        }
+        list.offset += list.used;
+    } while (list.used && list.offset < list.count);
+    log_line("No capture volume control named '%s' on %s\n", cdev_id, path);
+    close(ctl_fd);
+    ctl_fd = -1;
+    return NULL;
+}
+
+int sound_is_le(void)
+{
+    if (snd_format == SNDRV_PCM_FORMAT_S16_BE)
+        return 0;
+    return 1;
+}
+
+int sound_is_be(void)
+{
+    if (snd_format == SNDRV_PCM_FORMAT_S16_LE)
+        return 0;
+    return 1;
+}
+
+void sound_set_device(char *str)
+{
+    cdevice = strdup(str);
+}
+
+void sound_set_standby(char *str)
+{
+    log_line("alsakern: standby device %s ignored\n", str);
+}
+
+void sound_set_port(char *str)
+{
+    cdev_id = strdup(str);
+}
+
+void sound_set_sample_rate(int rate)
+{
+    if (rate > 0)
+        sample_rate = (unsigned)rate;
+    else
+        sample_rate = DEFAULT_SAMPLE_RATE;
+}
+
+void sound_set_skip_bytes(int sb)
+{
+    if (sb > 0)
+        skip_bytes = (unsigned)sb;
+    else
+        skip_bytes = DEFAULT_SKIP_BYTES;
+}
+
+void sound_set_period_size(int frames)
+{
+    if (frames > 0 && frames <= MAX_PERIOD_FRAMES)
+        period_frames = (unsigned long)frames;
+    else
+        period_frames = DEFAULT_PERIOD_FRAMES;
+}
+
+void sound_set_buffer_size(int frames)
+{
+    if (frames > 0)
+        buffer_frames = (unsigned long)frames;
+    else
+        buffer_frames = DEFAULT_BUFFER_FRAMES;
+}
@@ -0,0 +1,415 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * snd-egd-analyze: offline qualification of recorded captures.
+ *
+ * Each file is mapped and split into one contiguous range of frames per
+ * thread.  Every thread runs its range through its own libsndegd context,
+ * exactly as the daemon would, while also collecting statistics on the raw
+ * samples and on their differences.  The per-thread results are summed once
+ * all threads are done.  A range boundary only costs the priming frame and
+ * any half-collected bit pairs, which is negligible.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "extract.h"
+
+bool gflags_debug = 0;
+
+#define MAX_THREADS 256
+#define MAX_LAG 56
+#define OUT_CHUNK 65536
+#define BLOCK_FRAMES 16384
+
+static unsigned nthreads;
+static unsigned max_lag = 8;
+static bool raw_input;
+static struct sndegd_format raw_fmt = { .sample = SNDEGD_S16_LE, .channels = 2 };
+static enum sndegd_xform xform = SNDEGD_XFORM_DIFF;
+
+struct input {
+    const char *name;
+    const unsigned char *pcm;
+    size_t frames;
+    unsigned rate;
+    struct sndegd_format fmt;
+};
+
+struct result {
+    size_t frames;
+    unsigned long long out_bytes;
+    /* Histograms of raw sample values and of absolute differences. */
+    unsigned long long raw[SNDEGD_MAX_CHANNELS][65536];
+    unsigned long long delta[SNDEGD_MAX_CHANNELS][65536];
+    unsigned long long out_hist[256];
+    unsigned long long lag_bits;
+    unsigned long long lag_diff[MAX_LAG + 1];
+    struct sndegd_ctx ctx;
+    struct sndegd_stats stats;
+};
+
+struct job {
+    const struct input *in;
+    size_t first, count;
+    struct result *res;
+};
+
+static inline int load_sample(const unsigned char *p, enum sndegd_sample s)
+{
+    if (s == SNDEGD_S16_BE)
+        return (int16_t)(uint16_t)(p[0] << 8 | p[1]);
+    return (int16_t)(uint16_t)(p[1] << 8 | p[0]);
+}
+
+/* Bits are taken least significant first, in the order they were produced. */
+static void lag_update(struct result *r, uint64_t *hist, const unsigned char *b,
+                       size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        *hist = (*hist >> 8) | ((uint64_t)b[i] << 56);
+        if (r->out_bytes + i < 8)
+            continue;
+        r->lag_bits += 8;
+        for (unsigned k = 1; k <= max_lag; ++k) {
+            unsigned earlier = (unsigned)(*hist >> (56 - k)) & 0xff;
+            r->lag_diff[k] += (unsigned)__builtin_popcount((b[i] ^ earlier) & 0xff);
+        }
+    }
+}
+
+static void *analyze_range(void *arg)
+{
+    struct job *j = arg;
+    const struct input *in = j->in;
+    struct result *r = j->res;
+    size_t stride = sndegd_frame_size(&in->fmt);
+    const unsigned char *p = in->pcm + j->first * stride;
+    unsigned chans = MIN(in->fmt.channels, SNDEGD_MAX_CHANNELS);
+    unsigned char *out = malloc(OUT_CHUNK);
+    uint64_t hist = 0;
+
+    if (!out)
+        suicide("out of memory\n");
+    sndegd_init(&r->ctx);
+    sndegd_set_transform(&r->ctx, xform);
+    sndegd_set_stats(&r->ctx, &r->stats);
+
+    /* Work through the range a block at a time so that the extractor finds
+     * the samples still in cache after the statistics pass. */
+    int prev[SNDEGD_MAX_CHANNELS] = {0};
+    for (size_t blk = 0; blk < j->count; blk += BLOCK_FRAMES) {
+        size_t end = MIN(blk + BLOCK_FRAMES, j->count);
+        for (size_t i = blk; i < end; ++i) {
+            for (unsigned c = 0; c < chans; ++c) {
+                int s = load_sample(p + i * stride + c * sizeof(int16_t), in->fmt.sample);
+                r->raw[c][(uint16_t)s]++;
+                if (i)
+                    r->delta[c][(uint16_t)abs(s - prev[c])]++;
+                prev[c] = s;
+            }
+        }
+        for (size_t off = blk; off < end;) {
+            size_t used;
+            size_t n = sndegd_extract(&r->ctx, p + off * stride, end - off,
+                                      &in->fmt, out, OUT_CHUNK, &used);
+            for (size_t i = 0; i < n; ++i)
+                r->out_hist[out[i]]++;
+            lag_update(r, &hist, out, n);
+            r->out_bytes += n;
+            off += used;
+        }
+    }
+    r->frames = j->count;
+    free(out);
+    return NULL;
+}
+
+static double plane_ones(const unsigned long long *h, unsigned plane)
+{
+    unsigned long long ones = 0, n = 0;
+    for (size_t v = 0; v < 65536; ++v) {
+        n += h[v];
+        if (v >> plane & 1)
+            ones += h[v];
+    }
+    return n ? (double)ones / (double)n : 0.0;
+}
+
+static void report(const struct input *in, const struct result *t)
+{
+    unsigned chans = MIN(in->fmt.channels, SNDEGD_MAX_CHANNELS);
+    double in_bytes = (double)t->frames * (double)sndegd_frame_size(&in->fmt);
+
+    printf("%s: %zu frames, %u channels", in->name, t->frames, in->fmt.channels);
+    if (in->rate)
+        printf(", %u Hz, %.1f s", in->rate, (double)t->frames / in->rate);
+    printf("\n  output: %llu bytes, yield %.4f output bytes per input byte\n",
+           t->out_bytes, in_bytes > 0 ? (double)t->out_bytes / in_bytes : 0.0);
+
+    for (unsigned c = 0; c < chans; ++c) {
+        unsigned long long max = 0;
+        for (size_t v = 0; v < 65536; ++v)
+            max = MAX(max, t->raw[c][v]);
+        printf("\n  channel %u: raw min-entropy %.3f bits/sample (MCV)\n", c,
+               sndegd_mcv_min_entropy(max, t->frames));
+        printf("  plane  raw-ones  delta-ones  out-bytes  yield(bits/sample)  out-ones\n");
+        for (unsigned j = 0; j < SNDEGD_PLANES; ++j) {
+            unsigned long long bytes = 0, ones = 0;
+            for (size_t b = 0; b < 256; ++b) {
+                bytes += t->stats.bytes[c][j][b];
+                ones += (unsigned long long)t->stats.bytes[c][j][b]
+                        * (unsigned)__builtin_popcount((unsigned)b);
+            }
+            printf("  %5u  %8.4f  %10.4f  %9llu  %18.4f  %8.4f\n", j,
+                   plane_ones(t->raw[c], j), plane_ones(t->delta[c], j), bytes,
+                   t->frames ? 8.0 * (double)bytes / (double)t->frames : 0.0,
+                   bytes ? (double)ones / (8.0 * (double)bytes) : 0.0);
+        }
+    }
+
+    if (!t->out_bytes) {
+        printf("\n");
+        return;
+    }
+    double expect = (double)t->out_bytes / 256.0, chi = 0.0;
+    unsigned long long max = 0, ones = 0;
+    for (size_t b = 0; b < 256; ++b) {
+        double d = (double)t->out_hist[b] - expect;
+        chi += d * d / expect;
+        max = MAX(max, t->out_hist[b]);
+        ones += t->out_hist[b] * (unsigned)__builtin_popcount((unsigned)b);
+    }
+    /* Wilson-Hilferty: approximately standard normal for 255 dof. */
+    double k = 255.0;
+    double z = (cbrt(chi / k) - (1.0 - 2.0 / (9.0 * k))) / sqrt(2.0 / (9.0 * k));
+    printf("\n  output bias: %.6f ones\n", (double)ones / (8.0 * (double)t->out_bytes));
+    printf("  output chi-square: %.1f (255 dof, z = %.2f)\n", chi, z);
+    printf("  output min-entropy: %.4f bits/bit (MCV over bytes)\n",
+           sndegd_mcv_min_entropy(max, t->out_bytes) / 8.0);
+    if (t->lag_bits) {
+        printf("  output autocorrelation:");
+        for (unsigned l = 1; l <= max_lag; ++l)
+            printf(" lag%u=%+.5f", l,
+                   1.0 - 2.0 * (double)t->lag_diff[l] / (double)t->lag_bits);
+        printf("\n");
+    }
+    printf("\n");
+}
+
+static void merge(struct result *t, const struct result *r)
+{
+    t->frames += r->frames;
+    t->out_bytes += r->out_bytes;
+    t->lag_bits += r->lag_bits;
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c) {
+        for (size_t v = 0; v < 65536; ++v) {
+            t->raw[c][v] += r->raw[c][v];
+            t->delta[c][v] += r->delta[c][v];
+        }
+        for (size_t j = 0; j < SNDEGD_PLANES; ++j)
+            for (size_t b = 0; b < 256; ++b)
+                t->stats.bytes[c][j][b] += r->stats.bytes[c][j][b];
+    }
+    for (size_t b = 0; b < 256; ++b)
+        t->out_hist[b] += r->out_hist[b];
+    for (size_t l = 0; l <= MAX_LAG; ++l)
+        t->lag_diff[l] += r->lag_diff[l];
+}
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+           | (uint32_t)p[3] << 24;
+}
+
+static inline unsigned get_le16(const unsigned char *p)
+{
+    return (unsigned)p[0] | (unsigned)p[1] << 8;
+}
+
+/* Finds the PCM data in a 16-bit PCM WAV file. */
+static void parse_wav(struct input *in, const unsigned char *m, size_t size)
+{
+    if (size < 12 || memcmp(m, "RIFF", 4) || memcmp(m + 8, "WAVE", 4))
+        suicide("%s: not a WAV file; use --raw for headerless captures\n", in->name);
+    bool have_fmt = false;
+    for (size_t off = 12; off + 8 <= size;) {
+        const unsigned char *ck = m + off;
+        size_t len = get_le32(ck + 4);
+        size_t avail = size - off - 8;
+        if (!memcmp(ck, "fmt ", 4) && len >= 16 && avail >= 16) {
+            unsigned format = get_le16(ck + 8);
+            in->fmt.channels = get_le16(ck + 10);
+            in->rate = get_le32(ck + 12);
+            unsigned bits = get_le16(ck + 22);
+            if ((format != 1 && format != 0xfffe) || bits != 16 || !in->fmt.channels)
+                suicide("%s: only 16-bit PCM WAV files are supported\n", in->name);
+            in->fmt.sample = SNDEGD_S16_LE;
+            have_fmt = true;
+        } else if (!memcmp(ck, "data", 4)) {
+            if (!have_fmt)
+                suicide("%s: data chunk before fmt chunk\n", in->name);
+            /* A recording that was cut short has a zero or stale size. */
+            if (len == 0 || len > avail)
+                len = avail;
+            in->pcm = ck + 8;
+            in->frames = len / sndegd_frame_size(&in->fmt);
+            return;
+        }
+        off += 8 + len + (len & 1);
+    }
+    suicide("%s: no PCM data found\n", in->name);
+}
+
+static void analyze_file(const char *name)
+{
+    struct input in = { .name = name, .fmt = raw_fmt };
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        suicide("%s: %s\n", name, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st))
+        suicide("%s: stat failed: %s\n", name, strerror(errno));
+    size_t size = (size_t)st.st_size;
+    if (!size)
+        suicide("%s: empty file\n", name);
+    unsigned char *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED)
+        suicide("%s: mmap failed: %s\n", name, strerror(errno));
+    close(fd);
+    madvise(m, size, MADV_SEQUENTIAL);
+    madvise(m, size, MADV_WILLNEED);
+
+    if (raw_input) {
+        in.pcm = m;
+        in.frames = size / sndegd_frame_size(&in.fmt);
+    } else
+        parse_wav(&in, m, size);
+
+    size_t n = MAX(MIN((size_t)nthreads, in.frames / 4096), 1);
+    struct result *res = calloc(n + 1, sizeof *res);
+    struct job *jobs = calloc(n, sizeof *jobs);
+    pthread_t *tids = calloc(n, sizeof *tids);
+    if (!res || !jobs || !tids)
+        suicide("out of memory\n");
+    for (size_t i = 0; i < n; ++i) {
+        jobs[i].in = &in;
+        jobs[i].first = in.frames * i / n;
+        jobs[i].count = in.frames * (i + 1) / n - jobs[i].first;
+        jobs[i].res = &res[i + 1];
+        int r = pthread_create(&tids[i], NULL, analyze_range, &jobs[i]);
+        if (r)
+            suicide("pthread_create failed: %s\n", strerror(r));
+    }
+    for (size_t i = 0; i < n; ++i) {
+        pthread_join(tids[i], NULL);
+        merge(&res[0], &res[i + 1]);
+    }
+    report(&in, &res[0]);
+
+    free(tids);
+    free(jobs);
+    free(res);
+    munmap(m, size);
+}
+
+static void usage(void)
+{
+    printf("Measure how well recorded captures whiten, as snd-egd would see them.\n"
+           "Usage: snd-egd-analyze [options] FILE...\n\n");
+    printf("--threads         -t []  Number of threads (default: all CPUs)\n");
+    printf("--lag             -l []  Report output autocorrelation up to this lag (default 8, max %d)\n", MAX_LAG);
+    printf("--raw             -r     Files are headerless 16-bit PCM rather than WAV.\n"
+           "--channels        -c []  Channels in raw files (default 2)\n"
+           "--big-endian      -B     Raw files are big-endian (default little-endian)\n"
+           "--transform       -T []  auto, raw, diff, or diff2, as for snd-egd (default diff)\n"
+           "--help            -h     This help.\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct option long_options[] = {
+        {"threads", 1, NULL, 't'},
+        {"lag", 1, NULL, 'l'},
+        {"raw", 0, NULL, 'r'},
+        {"channels", 1, NULL, 'c'},
+        {"big-endian", 0, NULL, 'B'},
+        {"transform", 1, NULL, 'T'},
+        {"help", 0, NULL, 'h'},
+        {NULL, 0, NULL, 0 }
+    };
+
+    for (;;) {
+        int c = getopt_long(argc, argv, "t:l:rc:BT:h", long_options, (int *)0);
+        if (c == -1)
+            break;
+        int t;
+        switch (c) {
+            case 't':
+                t = atoi(optarg);
+                if (t > 0 && t <= MAX_THREADS) nthreads = (unsigned)t;
+                else suicide("thread count out of range: 1 to %d\n", MAX_THREADS);
+                break;
+
+            case 'l':
+                t = atoi(optarg);
+                if (t >= 0 && t <= MAX_LAG) max_lag = (unsigned)t;
+                else suicide("lag out of range: 0 to %d\n", MAX_LAG);
+                break;
+
+            case 'r':
+                raw_input = true;
+                break;
+
+            case 'c':
+                t = atoi(optarg);
+                if (t > 0 && t <= 64) raw_fmt.channels = (unsigned)t;
+                else suicide("channel count out of range: 1 to 64\n");
+                break;
+
+            case 'B':
+                raw_fmt.sample = SNDEGD_S16_BE;
+                break;
+
+            case 'T':
+                for (t = 0; t <= SNDEGD_XFORM_AUTO; ++t) {
+                    if (!strcmp(optarg, sndegd_xform_name((enum sndegd_xform)t)))
+                        break;
+                }
+                if (t > SNDEGD_XFORM_AUTO)
+                    suicide("unknown transform '%s'\n", optarg);
+                xform = (enum sndegd_xform)t;
+                break;
+
+            case 'h':
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (!nthreads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? (unsigned)MIN(n, MAX_THREADS) : 1;
+    }
+
+    for (int i = optind; i < argc; ++i)
+        analyze_file(argv[i]);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * The arena is a private anonymous mapping that is locked into RAM, excluded
+ * from core dumps, and wiped in any child that is forked, with an
+ * inaccessible guard page on either side so that an overrun of a buffer at
+ * either end faults rather than reaching other memory.
+ *
+ * arena_shared() maps a separate region the same way, except that it is
+ * shared with, rather than wiped in, children that are forked afterwards.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nk/log.h"
+#include "arena.h"
+
+static unsigned char *arena;
+static size_t arena_size, arena_off;
+
+/* Maps size bytes between two guard pages and locks them. */
+static unsigned char *map_locked(size_t *size, int flags, bool must_lock)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    *size = (*size + page - 1) & ~(page - 1);
+    unsigned char *p = mmap(NULL, *size + 2 * page, PROT_NONE,
+                            flags | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        suicide("arena: mmap failed: %s\n", strerror(errno));
+    p += page;
+    if (mprotect(p, *size, PROT_READ | PROT_WRITE))
+        suicide("arena: mprotect failed: %s\n", strerror(errno));
+    if (mlock(p, *size)) {
+        if (must_lock)
+            suicide("arena: could not lock %zu bytes: %s\n", *size, strerror(errno));
+        log_line("arena: could not lock %zu bytes: %s\n", *size, strerror(errno));
+    }
+    if (madvise(p, *size, MADV_DONTDUMP))
+        log_line("arena: MADV_DONTDUMP failed: %s\n", strerror(errno));
+    return p;
+}
+
+/*
+ * Without must_lock, failing to lock the arena is only a warning; that is
+ * for unprivileged raw output, where RLIMIT_MEMLOCK may be too small.
+ */
+void arena_init(size_t size, bool must_lock)
+{
+    arena = map_locked(&size, MAP_PRIVATE, must_lock);
+#ifdef MADV_WIPEONFORK
+    if (madvise(arena, size, MADV_WIPEONFORK))
+        log_line("arena: MADV_WIPEONFORK failed: %s\n", strerror(errno));
+#endif
+    arena_size = size;
+}
+
+/*
+ * Returns zeroed, locked memory that stays shared with children forked
+ * later.  mlock() is not inherited, but the pages stay resident for as long
+ * as the caller keeps them locked.
+ */
+void *arena_shared(size_t size)
+{
+    return map_locked(&size, MAP_SHARED, true);
+}
+
+/* Returns zeroed memory aligned to ARENA_ALIGN. */
+void *arena_alloc(size_t size)
+{
+    size_t n = ARENA_SIZE(size);
+
+    if (!arena)
+        suicide("arena: used before arena_init()\n");
+    if (n > arena_size - arena_off)
+        suicide("arena: out of space (%zu of %zu bytes used, %zu wanted)\n",
+                arena_off, arena_size, n);
+    void *r = arena + arena_off;
+    arena_off += n;
+    return r;
+}
+
+size_t arena_used(void)
+{
+    return arena_off;
+}
@@ -0,0 +1,23 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_ARENA_H_
+#define NJK_ARENA_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A single locked region that holds every buffer that carries entropy.  It
+ * is sized once up front, so the amount of locked memory is known and small.
+ * Allocations are never freed.
+ */
+
+/* Space that arena_alloc(n) consumes, for sizing the arena. */
+#define ARENA_ALIGN 64
+#define ARENA_SIZE(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(size_t size, bool must_lock);
+void *arena_alloc(size_t size);
+void *arena_shared(size_t size);
+size_t arena_used(void);
+
+#endif
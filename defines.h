@@ -14,14 +14,16 @@
 
 #define PAGE_SIZE 4096
 
-#define USE_AMLS 1
-
 #define RANDOM_DEVICE               "/dev/random"
 #define DEFAULT_PID_FILE            "/var/run/snd-egd.pid"
 #define DEFAULT_HW_DEVICE           "hw:0"
 #define DEFAULT_HW_ITEM             "capture"
 #define DEFAULT_SAMPLE_RATE         48000
 #define DEFAULT_SKIP_BYTES          (48000 * 4 * 1)
+#define DEFAULT_PERIOD_FRAMES       1024
+#define DEFAULT_BUFFER_FRAMES       8192
+#define MAX_PERIOD_FRAMES           8192
+#define MAX_READ_FRAMES             262144
 #define DEFAULT_MAX_BIT             16
 #define DEFAULT_POOLSIZE_FN         "/proc/sys/kernel/random/poolsize"
 #define DEFAULT_REFILL_SECS         60
@@ -0,0 +1,211 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * --predict: a forecast of when the kernel will want entropy, so that the
+ * pool can be topped up just before a burst of demand instead of up to a
+ * whole refill interval after it.
+ *
+ * Demand is sampled at every wakeup of the feeder: a burst is either the
+ * kernel waking writers of the random device (POLLOUT), or its entropy
+ * count having dropped to half the pool or less.  The day is divided into
+ * DEMAND_BUCKETS buckets of local time, and each keeps an exponentially
+ * weighted estimate of how likely a burst is in it, updated once a day as
+ * the bucket closes.  That catches cron jobs and daily traffic peaks; a
+ * bucket that had no sample at all is left alone.
+ *
+ * A POLLOUT wakeup with the pool already full means that the kernel reports
+ * the device writable regardless, as newer ones do, or that something else
+ * refilled the pool first.  POLLOUT is then ignored until the next bucket,
+ * so that one such wakeup does not turn it off for good.
+ *
+ * When the next bucket is likely to see a burst, the feeder wakes up and
+ * refills a lead time before the bucket starts.  The lead is twice the
+ * average time that a refill has taken, so that the ring buffer and the
+ * kernel pool are both full when the burst arrives.
+ */
+#include <stdbool.h>
+#include <time.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "demand.h"
+
+extern bool gflags_debug;
+
+#define DEMAND_BUCKET_SECS 300
+#define DEMAND_BUCKETS (24 * 3600 / DEMAND_BUCKET_SECS)
+#define DEMAND_ALPHA 0.25     /* weight of the newest day in a bucket's estimate */
+#define DEMAND_LIKELY 0.5     /* estimate at or above which a burst is predicted */
+#define DEMAND_MIN_LEAD 5.0   /* seconds */
+
+static bool enabled;
+static unsigned pool_bits;
+static float likely[DEMAND_BUCKETS];
+
+/* The bucket being observed, as a count of buckets since the epoch. */
+static struct {
+    long long abs;
+    bool sampled, burst, predicted;
+    time_t prefilled;
+} cur = { .abs = -1 };
+static time_t next_prefilled;
+static double fill_secs = DEMAND_MIN_LEAD / 2;
+static bool pollout_useful = true;
+
+static unsigned long samples, bursts, hits, predictions, false_alarms, leads;
+static double lead_sum;
+
+void demand_set_enabled(bool on)
+{
+    enabled = on;
+}
+
+bool demand_enabled(void)
+{
+    return enabled;
+}
+
+/* Must be called before chrooting, so that the local time zone is loaded. */
+void demand_init(unsigned max_bits)
+{
+    pool_bits = max_bits;
+    tzset();
+}
+
+/* Local time as seconds since the epoch, so that buckets follow the clock. */
+static long long local_secs(time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return (long long)t + tm.tm_gmtoff;
+}
+
+static size_t bucket_of(long long abs)
+{
+    return (size_t)(abs % DEMAND_BUCKETS);
+}
+
+static double lead_secs(void)
+{
+    return MAX(DEMAND_MIN_LEAD, 2.0 * fill_secs);
+}
+
+static void close_bucket(void)
+{
+    if (cur.abs < 0 || !cur.sampled)
+        return;
+    float *p = &likely[bucket_of(cur.abs)];
+    *p = (float)((1.0 - DEMAND_ALPHA) * *p + DEMAND_ALPHA * (cur.burst ? 1.0 : 0.0));
+    if (cur.predicted && !cur.burst)
+        ++false_alarms;
+}
+
+static void roll(time_t now)
+{
+    long long abs = local_secs(now) / DEMAND_BUCKET_SECS;
+    if (abs == cur.abs)
+        return;
+    close_bucket();
+    bool was_next = abs == cur.abs + 1;
+    cur.abs = abs;
+    cur.sampled = cur.burst = false;
+    cur.predicted = likely[bucket_of(abs)] >= DEMAND_LIKELY;
+    cur.prefilled = was_next ? next_prefilled : 0;
+    next_prefilled = 0;
+    if (cur.predicted)
+        ++predictions;
+    if (!pollout_useful && gflags_debug)
+        log_line("polling the random device for writability again\n");
+    pollout_useful = true;
+}
+
+/* Whether POLLOUT on the random device means that the kernel wants entropy. */
+bool demand_use_pollout(void)
+{
+    return pollout_useful;
+}
+
+/*
+ * Records one observation of the kernel's entropy count, and whether the
+ * kernel had asked for entropy.
+ * @return whether the kernel really asked
+ */
+bool demand_sample(int avail, bool asked)
+{
+    time_t now = time(NULL);
+
+    roll(now);
+    if (asked && avail >= 0 && (unsigned)avail >= pool_bits) {
+        if (gflags_debug) log_line("random device is writable with a full pool; not polling it this bucket\n");
+        pollout_useful = false;
+        asked = false;
+    }
+    ++samples;
+    cur.sampled = true;
+    bool burst = asked || (avail >= 0 && (unsigned)avail <= pool_bits / 2);
+    if (!burst || cur.burst)
+        return asked;
+    cur.burst = true;
+    ++bursts;
+    if (cur.predicted) {
+        ++hits;
+        if (cur.prefilled) {
+            ++leads;
+            lead_sum += difftime(now, cur.prefilled);
+        }
+    }
+    if (gflags_debug) log_line("entropy demand: %d bits available%s%s\n", avail,
+                               asked ? ", kernel asked for more" : "",
+                               cur.predicted ? ", as predicted" : "");
+    return asked;
+}
+
+void demand_note_fill(double secs)
+{
+    fill_secs = 0.75 * fill_secs + 0.25 * secs;
+}
+
+/* Seconds until the next bucket starts, and until it should be prefilled. */
+static double next_bucket_in(time_t now)
+{
+    long long l = local_secs(now);
+    return (double)((l / DEMAND_BUCKET_SECS + 1) * DEMAND_BUCKET_SECS - l);
+}
+
+/*
+ * How long the feeder may sleep before it must sample again: until the next
+ * bucket starts, or until a predicted burst must be prefilled.
+ */
+long demand_timeout_ms(void)
+{
+    time_t now = time(NULL);
+    roll(now);
+    double t = next_bucket_in(now);
+    if (!next_prefilled && likely[bucket_of(cur.abs + 1)] >= DEMAND_LIKELY)
+        t = MAX(0.0, t - lead_secs());
+    return (long)(t * 1000.0) + 1;
+}
+
+/* True, once, when the next bucket is predicted busy and its lead has come. */
+bool demand_prefill_due(void)
+{
+    time_t now = time(NULL);
+    roll(now);
+    if (next_prefilled || likely[bucket_of(cur.abs + 1)] < DEMAND_LIKELY
+        || next_bucket_in(now) > lead_secs())
+        return false;
+    next_prefilled = now;
+    if (gflags_debug) log_line("entropy demand predicted in %.0fs; refilling now\n",
+                               next_bucket_in(now));
+    return true;
+}
+
+void demand_print_stats(void)
+{
+    if (!enabled || !gflags_debug)
+        return;
+    log_line("demand forecast: %lu samples, %lu bursts, %lu predicted (hit rate %.1f%%), %lu false alarms\n",
+             samples, bursts, hits, bursts ? 100.0 * (double)hits / (double)bursts : 0.0,
+             false_alarms);
+    log_line("demand forecast: %lu predictions, mean lead %.1fs over %lu prefills, target lead %.1fs\n",
+             predictions, leads ? lead_sum / (double)leads : 0.0, leads, lead_secs());
+}
@@ -0,0 +1,17 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_DEMAND_H_
+#define NJK_DEMAND_H_
+#include <stdbool.h>
+
+void demand_set_enabled(bool on);
+bool demand_enabled(void);
+void demand_init(unsigned max_bits);
+bool demand_use_pollout(void);
+bool demand_sample(int avail, bool asked);
+void demand_note_fill(double secs);
+long demand_timeout_ms(void);
+bool demand_prefill_due(void);
+void demand_print_stats(void);
+
+#endif
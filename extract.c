@@ -0,0 +1,536 @@
+// Copyright 2008-2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * The extractor proper: differencing followed by von Neumann / AMLS
+ * whitening of each bit plane.  See extract.h.  Nothing in here touches
+ * global state, so it can be built into libsndegd and used from any number
+ * of threads on separate contexts.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "extract.h"
+
+/* libsndegd does not include the daemon's defines.h. */
+#define USE_AMLS 1
+
+struct vn_out {
+    unsigned char *buf;
+    size_t len, cap;
+};
+
+static inline bool vn_out_full(const struct vn_out *o)
+{
+    return o->len + SNDEGD_MAX_OUT_PER_FRAME > o->cap;
+}
+
+static inline void vn_store(struct sndegd_ctx *ctx, struct vn_out *o,
+                            size_t c, size_t j, unsigned char b)
+{
+    if (ctx->stats)
+        ctx->stats->bytes[c][j][b] += 1;
+    o->buf[o->len++] = b;
+}
+
+static void vn_state_init(vn_renorm_state_t *st)
+{
+    for (size_t j = 0; j < 16; ++j) {
+        st->bits_out[j] = 0;
+        st->byte_out[j] = 0;
+        st->prev_bits[j] = -1;
+        for (size_t d = 0; d < 2; ++d) {
+            st->amls_bits_out[d][j] = 0;
+            st->amls_byte_out[d][j] = 0;
+            st->amls_bits[d][j] = -1;
+        }
+    }
+}
+
+/* Drops the half-collected pairs of plane j. */
+static inline void vn_forget(vn_renorm_state_t *st, size_t j)
+{
+    st->prev_bits[j] = -1;
+    st->amls_bits[0][j] = -1;
+    st->amls_bits[1][j] = -1;
+}
+
+void sndegd_init(struct sndegd_ctx *ctx)
+{
+    memset(ctx, 0, sizeof *ctx);
+    ctx->channel_hi = SNDEGD_MAX_CHANNELS;
+    ctx->plane_hi = SNDEGD_PLANES;
+    sndegd_set_transform(ctx, SNDEGD_XFORM_DIFF);
+    sndegd_reset(ctx);
+}
+
+/*
+ * Pairs that were left half-collected in a plane that changes transform are
+ * dropped, so that bits of two different transforms are never paired.
+ */
+static void xform_set(struct sndegd_ctx *ctx, size_t c, size_t j,
+                      enum sndegd_xform t)
+{
+    uint16_t bit = (uint16_t)(1u << j);
+
+    for (size_t k = 0; k < SNDEGD_XFORMS; ++k)
+        ctx->xform_mask[c][k] &= (uint16_t)~bit;
+    ctx->xform_mask[c][t] |= bit;
+    if (ctx->xform[c][j] != t) {
+        vn_forget(&ctx->vn[c], j);
+        ctx->xform[c][j] = (unsigned char)t;
+    }
+}
+
+/*
+ * Uses the same transform for every plane, or with SNDEGD_XFORM_AUTO, lets
+ * the context choose, starting from SNDEGD_XFORM_DIFF.
+ */
+void sndegd_set_transform(struct sndegd_ctx *ctx, enum sndegd_xform xform)
+{
+    if (xform > SNDEGD_XFORM_AUTO)
+        return;
+    enum sndegd_xform t = xform == SNDEGD_XFORM_AUTO ? SNDEGD_XFORM_DIFF : xform;
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c) {
+        for (size_t j = 0; j < SNDEGD_PLANES; ++j) {
+            xform_set(ctx, c, j, t);
+            ctx->xform_want[c][j] = (unsigned char)t;
+            ctx->xform_dwell[c][j] = 0;
+        }
+    }
+    ctx->xform_mode = xform;
+    ctx->eval_frame = 0;
+    ctx->eval_half = false;
+    ctx->eval_npairs = 0;
+    ctx->eval_nframes = 0;
+    memset(ctx->eval_pairs, 0, sizeof ctx->eval_pairs);
+    memset(ctx->eval_ones, 0, sizeof ctx->eval_ones);
+    memset(ctx->eval_both, 0, sizeof ctx->eval_both);
+    memset(ctx->eval_absdiff, 0, sizeof ctx->eval_absdiff);
+    memset(ctx->eval_sel_ones, 0, sizeof ctx->eval_sel_ones);
+    memset(ctx->eval_sel_both, 0, sizeof ctx->eval_sel_both);
+}
+
+const char *sndegd_xform_name(enum sndegd_xform xform)
+{
+    switch (xform) {
+    case SNDEGD_XFORM_RAW: return "raw";
+    case SNDEGD_XFORM_DIFF: return "diff";
+    case SNDEGD_XFORM_DIFF2: return "diff2";
+    case SNDEGD_XFORM_AUTO: return "auto";
+    }
+    return "?";
+}
+
+/*
+ * Restricts a context to some of the channels and bit planes.  Every bit
+ * plane is an independent stream, so contexts that cover disjoint planes
+ * can be run over the same input concurrently.
+ */
+bool sndegd_set_planes(struct sndegd_ctx *ctx, unsigned channel_lo,
+                       unsigned channel_hi, unsigned plane_lo,
+                       unsigned plane_hi)
+{
+    if (channel_lo >= channel_hi || channel_hi > SNDEGD_MAX_CHANNELS
+        || plane_lo >= plane_hi || plane_hi > SNDEGD_PLANES)
+        return false;
+    ctx->channel_lo = channel_lo;
+    ctx->channel_hi = channel_hi;
+    ctx->plane_lo = plane_lo;
+    ctx->plane_hi = plane_hi;
+    return true;
+}
+
+/*
+ * Counts the output of the context in 'stats', which may be shared with no
+ * other context that is used concurrently; NULL stops counting.
+ */
+void sndegd_set_stats(struct sndegd_ctx *ctx, struct sndegd_stats *stats)
+{
+    ctx->stats = stats;
+}
+
+/* Forgets everything but the statistics, including partially built bytes. */
+void sndegd_reset(struct sndegd_ctx *ctx)
+{
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c)
+        vn_state_init(&ctx->vn[c]);
+    ctx->primed = 0;
+    ctx->eval_half = false;
+}
+
+/*
+ * Forget any half-collected bit pairs and the previous frame.  Used when the
+ * input stream has a gap so that samples from either side of it are never
+ * paired with each other.
+ */
+void sndegd_discontinuity(struct sndegd_ctx *ctx)
+{
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c) {
+        for (size_t j = 0; j < SNDEGD_PLANES; ++j)
+            vn_forget(&ctx->vn[c], j);
+    }
+    ctx->primed = 0;
+    ctx->eval_half = false;
+}
+
+size_t sndegd_frame_size(const struct sndegd_format *fmt)
+{
+    return fmt->channels * sizeof(int16_t);
+}
+
+#ifdef USE_AMLS
+static void vn_renorm_amls(struct sndegd_ctx *ctx, struct vn_out *o, size_t c,
+                           char new, size_t j, int diffbits)
+{
+    vn_renorm_state_t *st = &ctx->vn[c];
+
+    // No previous bit pairs is stored
+    if (st->amls_bits[diffbits][j] == -1) {
+        st->amls_bits[diffbits][j] = new;
+        return;
+    }
+
+    // If this bit pair != previous bit pair, store a bit
+    if (st->amls_bits[diffbits][j] == new) {
+        st->amls_bits[diffbits][j] = -1;
+        return;
+    }
+
+    if (st->amls_bits[diffbits][j])
+        st->amls_byte_out[diffbits][j] |= 1 << st->amls_bits_out[diffbits][j];
+    st->amls_bits_out[diffbits][j]++;
+    st->amls_bits[diffbits][j] = -1;
+
+    /* See if we've collected an entire byte.  If so, then copy
+     * it into the output buffer. */
+    if (st->amls_bits_out[diffbits][j] == 8) {
+        unsigned char b = st->amls_byte_out[diffbits][j];
+        st->amls_bits_out[diffbits][j] = 0;
+        st->amls_byte_out[diffbits][j] = 0;
+        vn_store(ctx, o, c, j, b);
+    }
+}
+#else
+static void vn_renorm_amls(struct sndegd_ctx *ctx, struct vn_out *o, size_t c,
+                           char new, size_t j, int diffbits)
+{
+}
+#endif
+
+/*
+ * We assume that the chance of a given bit in a sample being a 0 or 1 is not
+ * equal.  It is thus a statistically unfair 'coin'.  We can nevertheless use
+ * this sample as if it were a fair 'coin' if we use a special procedure:
+ *
+ * 1. Take a pair of bits of fixed significance in the output
+ * 2. If 01, treat as a zero bit.
+ * 3. If 10, treat as a one bit.
+ * 4. Otherwise, discard as no result.
+ */
+static void vn_renorm(struct sndegd_ctx *ctx, struct vn_out *o, size_t c,
+                      uint16_t i)
+{
+    vn_renorm_state_t *st = &ctx->vn[c];
+
+    /* process bits */
+    for (size_t j = ctx->plane_lo; j < ctx->plane_hi; ++j) {
+        /* Select the bit of given significance. */
+        char new = (i >> j) & 0x01;
+
+        /* We've not yet collected two bits; move on. */
+        if (st->prev_bits[j] == -1) {
+            st->prev_bits[j] = new;
+            continue;
+        }
+
+        /* If the bits are equal, discard both. */
+        if (st->prev_bits[j] == new) {
+            st->prev_bits[j] = -1;
+            vn_renorm_amls(ctx, o, c, new, j, 0);
+            continue;
+        }
+
+        /* If 10, mark the bit as 1.  Otherwise, it's 01 and the bit
+         * is already marked as 0. */
+        if (st->prev_bits[j])
+            st->byte_out[j] |= 1 << st->bits_out[j];
+        st->bits_out[j]++;
+        st->prev_bits[j] = -1;
+        vn_renorm_amls(ctx, o, c, new, j, 1);
+
+        /* See if we've collected an entire byte.  If so, then copy
+         * it into the output buffer. */
+        if (st->bits_out[j] == 8) {
+            unsigned char b = st->byte_out[j];
+            st->bits_out[j] = 0;
+            st->byte_out[j] = 0;
+            vn_store(ctx, o, c, j, b);
+        }
+    }
+}
+
+static inline int load_sample(const unsigned char *p, enum sndegd_sample s)
+{
+    if (s == SNDEGD_S16_BE)
+        return (int16_t)(uint16_t)(p[0] << 8 | p[1]);
+    return (int16_t)(uint16_t)(p[1] << 8 | p[0]);
+}
+
+/* Loads the first min(channels, SNDEGD_MAX_CHANNELS) samples of a frame. */
+static inline unsigned load_frame(int *s, const unsigned char *p,
+                                  const struct sndegd_format *fmt)
+{
+    unsigned n = fmt->channels < SNDEGD_MAX_CHANNELS ? fmt->channels : SNDEGD_MAX_CHANNELS;
+    for (unsigned c = 0; c < n; ++c)
+        s[c] = load_sample(p + c * sizeof(int16_t), fmt->sample);
+    return n;
+}
+
+/*
+ * The absolute second difference of 16-bit samples can reach 131070.
+ * Values past 16 bits saturate rather than wrap, so that a large swing
+ * never lands in the low planes.
+ */
+static inline uint16_t xform_diff2(int s, int prev, int prev2)
+{
+    int d = abs(s - 2 * prev + prev2);
+    return (uint16_t)(d < 0xffff ? d : 0xffff);
+}
+
+/*
+ * Counts the von Neumann pairs that every transform would have produced,
+ * and how the selected planes of the value actually used, sel, coincide.
+ */
+static inline void xform_eval(struct sndegd_ctx *ctx, size_t c,
+                              const uint16_t *v, uint16_t sel,
+                              uint16_t planes)
+{
+    ctx->eval_absdiff[c] += v[SNDEGD_XFORM_DIFF];
+    for (uint16_t m = sel & planes; m; m &= (uint16_t)(m - 1)) {
+        size_t j = (size_t)__builtin_ctz(m);
+        ++ctx->eval_sel_ones[c][j];
+        for (uint16_t k = m & (uint16_t)(m - 1); k; k &= (uint16_t)(k - 1))
+            ++ctx->eval_sel_both[c][j][__builtin_ctz(k)];
+    }
+    for (size_t t = 0; t < SNDEGD_XFORMS; ++t) {
+        for (uint16_t m = v[t] & planes; m; m &= (uint16_t)(m - 1))
+            ++ctx->eval_ones[c][t][__builtin_ctz(m)];
+        for (uint16_t m = v[t] & (v[t] >> 1) & planes; m; m &= (uint16_t)(m - 1))
+            ++ctx->eval_both[c][t][__builtin_ctz(m)];
+        if (!ctx->eval_half) {
+            ctx->eval_first[c][t] = v[t];
+            continue;
+        }
+        uint16_t first = ctx->eval_first[c][t];
+        for (uint16_t m = (first | v[t]) & planes; m; m &= (uint16_t)(m - 1)) {
+            size_t j = (size_t)__builtin_ctz(m);
+            ++ctx->eval_pairs[c][t][j][(first >> j & 1) << 1 | (v[t] >> j & 1)];
+        }
+    }
+}
+
+/*
+ * Correlation of two bits that are set a and b times out of n, and both
+ * set ab times, in standard deviations; 0 if either never changes.
+ */
+static double phi_z(double n, double a, double b, double ab)
+{
+    double den = a * (n - a) * b * (n - b);
+    if (den <= 0.0)
+        return 0.0;
+    return fabs(n * ab - a * b) * sqrt(n / den);
+}
+
+/*
+ * Yield of a transform for a plane, or 0 if it does not qualify with every
+ * test within z standard deviations.
+ */
+static unsigned xform_yield(const struct sndegd_ctx *ctx, size_t c, size_t t,
+                            size_t j, double z)
+{
+    const unsigned *p = ctx->eval_pairs[c][t][j];
+    double n = ctx->eval_npairs, n01 = p[1], n10 = p[2], n11 = p[3];
+    double d = n01 - n10;
+
+    if (t == SNDEGD_XFORM_RAW
+        && (4ul << j) * ctx->eval_nframes > ctx->eval_absdiff[c])
+        return 0;
+    if (d * d > z * z * (n01 + n10))
+        return 0;
+    if (phi_z(n, n10 + n11, n01 + n11, n11) > z)
+        return 0;
+    if (j + 1 < SNDEGD_PLANES
+        && phi_z(ctx->eval_nframes, ctx->eval_ones[c][t][j],
+                 ctx->eval_ones[c][t][j + 1], ctx->eval_both[c][t][j]) > z)
+        return 0;
+    return p[1] + p[2];
+}
+
+/*
+ * Returns the selected planes of a channel that must fall back to the first
+ * difference because they are correlated with another selected plane.
+ */
+static uint16_t xform_cross(const struct sndegd_ctx *ctx, size_t c)
+{
+    uint16_t r = 0;
+
+    for (size_t j = ctx->plane_lo; j < ctx->plane_hi; ++j) {
+        for (size_t k = j + 1; k < ctx->plane_hi; ++k) {
+            size_t lo = ctx->xform[c][j], hi = ctx->xform[c][k];
+            if (lo == SNDEGD_XFORM_DIFF && hi == SNDEGD_XFORM_DIFF)
+                continue;
+            if (phi_z(SNDEGD_EVAL_FRAMES, ctx->eval_sel_ones[c][j],
+                      ctx->eval_sel_ones[c][k], ctx->eval_sel_both[c][j][k])
+                <= SNDEGD_EVAL_MAX_Z)
+                continue;
+            r |= (uint16_t)(1u << (hi != SNDEGD_XFORM_DIFF ? k : j));
+        }
+    }
+    return r;
+}
+
+static void xform_decide(struct sndegd_ctx *ctx, unsigned chi)
+{
+    for (size_t c = ctx->channel_lo; c < chi; ++c) {
+        uint16_t cross = xform_cross(ctx, c);
+        for (size_t j = ctx->plane_lo; j < ctx->plane_hi; ++j) {
+            size_t cur = ctx->xform[c][j], best = cur;
+            unsigned cur_y = xform_yield(ctx, c, cur, j, SNDEGD_EVAL_MAX_Z);
+            unsigned best_y = 0;
+            for (size_t t = 0; t < SNDEGD_XFORMS; ++t) {
+                unsigned y = t == cur ? cur_y
+                    : xform_yield(ctx, c, t, j, SNDEGD_EVAL_ENTER_Z);
+                if (y > best_y) {
+                    best = t;
+                    best_y = y;
+                }
+            }
+            bool fallback = (cross >> j & 1) || !cur_y;
+            if (cross >> j & 1)
+                best = SNDEGD_XFORM_DIFF;
+            else if (!cur_y && !best_y)
+                best = SNDEGD_XFORM_DIFF;
+            else if (cur_y && (unsigned long long)best_y * 100
+                     <= (unsigned long long)cur_y * (100 + SNDEGD_EVAL_MARGIN))
+                best = cur;
+            /* Falling back is immediate; anything else must keep winning. */
+            if (best != cur && !(fallback && best == SNDEGD_XFORM_DIFF)) {
+                if (ctx->xform_want[c][j] != best) {
+                    ctx->xform_want[c][j] = (unsigned char)best;
+                    ctx->xform_dwell[c][j] = 0;
+                }
+                if (++ctx->xform_dwell[c][j] < SNDEGD_EVAL_DWELL)
+                    continue;
+            }
+            ctx->xform_want[c][j] = (unsigned char)best;
+            ctx->xform_dwell[c][j] = 0;
+            if (best != cur) {
+                xform_set(ctx, c, j, (enum sndegd_xform)best);
+                ++ctx->xform_switches;
+            }
+        }
+    }
+    memset(ctx->eval_sel_ones, 0, sizeof ctx->eval_sel_ones);
+    memset(ctx->eval_sel_both, 0, sizeof ctx->eval_sel_both);
+    /* Halve every count, keeping them consistent with each other. */
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c) {
+        for (size_t j = 0; j < SNDEGD_PLANES; ++j) {
+            for (size_t t = 0; t < SNDEGD_XFORMS; ++t) {
+                for (size_t k = 1; k < 4; ++k)
+                    ctx->eval_pairs[c][t][j][k] /= 2;
+                ctx->eval_ones[c][t][j] /= 2;
+                ctx->eval_both[c][t][j] /= 2;
+            }
+        }
+    }
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c)
+        ctx->eval_absdiff[c] /= 2;
+    ctx->eval_npairs /= 2;
+    ctx->eval_nframes /= 2;
+}
+
+/* Advances the evaluation window by a frame. */
+static inline void xform_tick(struct sndegd_ctx *ctx, unsigned chi)
+{
+    if (ctx->eval_frame < SNDEGD_EVAL_FRAMES) {
+        ++ctx->eval_nframes;
+        ctx->eval_npairs += ctx->eval_half;
+        ctx->eval_half = !ctx->eval_half;
+    }
+    if (++ctx->eval_frame == SNDEGD_EVAL_FRAMES)
+        xform_decide(ctx, chi);
+    else if (ctx->eval_frame == SNDEGD_EVAL_PERIOD)
+        ctx->eval_frame = 0;
+}
+
+/*
+ * Whitens up to 'frames' frames of PCM into 'out'.  Each sample is replaced
+ * by its transform, by default the absolute difference from the previous
+ * sample of its channel, before its bits are whitened.  Extraction stops
+ * early, between frames, once 'out' might not have room for the output of
+ * another frame;
+ * at least one frame is always consumed if outlen >= SNDEGD_MAX_OUT_PER_FRAME.
+ *
+ * @return number of bytes written to out; *consumed is set to the number of
+ * frames that were used
+ */
+size_t sndegd_extract(struct sndegd_ctx *ctx, const void *pcm, size_t frames,
+                      const struct sndegd_format *fmt, unsigned char *out,
+                      size_t outlen, size_t *consumed)
+{
+    struct vn_out o = { .buf = out, .cap = outlen };
+    const unsigned char *p = pcm;
+    size_t stride = sndegd_frame_size(fmt);
+    unsigned chi = ctx->channel_hi < fmt->channels ? ctx->channel_hi : fmt->channels;
+    uint16_t planes = (uint16_t)(((1u << ctx->plane_hi) - 1) & ~((1u << ctx->plane_lo) - 1));
+    size_t i = 0;
+
+    for (; i < frames && !vn_out_full(&o); ++i, p += stride) {
+        int s[SNDEGD_MAX_CHANNELS] = { 0 };
+        load_frame(s, p, fmt);
+        if (ctx->primed < (ctx->xform_mode == SNDEGD_XFORM_DIFF ? 1u : 2u)) {
+            memcpy(ctx->prev2, ctx->prev, sizeof ctx->prev2);
+            memcpy(ctx->prev, s, sizeof s);
+            ++ctx->primed;
+            continue;
+        }
+        if (ctx->xform_mode == SNDEGD_XFORM_DIFF) {
+            for (unsigned c = ctx->channel_lo; c < chi; ++c)
+                vn_renorm(ctx, &o, c, (uint16_t)abs(s[c] - ctx->prev[c]));
+        } else {
+            bool eval = ctx->xform_mode == SNDEGD_XFORM_AUTO
+                        && ctx->eval_frame < SNDEGD_EVAL_FRAMES;
+            for (unsigned c = ctx->channel_lo; c < chi; ++c) {
+                const uint16_t *m = ctx->xform_mask[c];
+                uint16_t v[SNDEGD_XFORMS] = {
+                    (uint16_t)s[c],
+                    (uint16_t)abs(s[c] - ctx->prev[c]),
+                    xform_diff2(s[c], ctx->prev[c], ctx->prev2[c]),
+                };
+                uint16_t sel = (uint16_t)((v[0] & m[0]) | (v[1] & m[1]) | (v[2] & m[2]));
+                if (eval)
+                    xform_eval(ctx, c, v, sel, planes);
+                vn_renorm(ctx, &o, c, sel);
+            }
+            if (ctx->xform_mode == SNDEGD_XFORM_AUTO)
+                xform_tick(ctx, chi);
+        }
+        memcpy(ctx->prev2, ctx->prev, sizeof ctx->prev2);
+        memcpy(ctx->prev, s, sizeof s);
+    }
+    *consumed = i;
+    return o.len;
+}
+
+/*
+ * NIST SP 800-90B most common value estimate, in bits per symbol, from the
+ * count of the most common of n symbols.
+ */
+double sndegd_mcv_min_entropy(unsigned long long max, unsigned long long n)
+{
+    if (n < 2)
+        return 0.0;
+    double p = (double)max / (double)n;
+    double pu = fmin(1.0, p + 2.576 * sqrt(p * (1.0 - p) / (double)(n - 1)));
+    return -log2(pu);
+}
@@ -0,0 +1,172 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_EXTRACT_H_
+#define NJK_EXTRACT_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libsndegd: the snd-egd extractor as a reentrant library.
+ *
+ * PCM frames go in, whitened bytes come out.  All state lives in a
+ * caller-allocated struct sndegd_ctx, so any number of streams can be
+ * processed at once, and the library never does I/O or allocates.
+ *
+ *   struct sndegd_ctx ctx;
+ *   struct sndegd_format fmt = { .sample = SNDEGD_S16_LE, .channels = 2 };
+ *   sndegd_init(&ctx);
+ *   while (frames) {
+ *       size_t used, n = sndegd_extract(&ctx, pcm, frames, &fmt,
+ *                                       out, sizeof out, &used);
+ *       consume(out, n);
+ *       pcm += used * sndegd_frame_size(&fmt);
+ *       frames -= used;
+ *   }
+ *
+ * The first frame after sndegd_init(), sndegd_reset(), or
+ * sndegd_discontinuity() only primes the differencing step, and so does the
+ * second unless every plane uses the first difference; consecutive calls on
+ * the same context are otherwise treated as one continuous stream.
+ *
+ * Each plane of a channel is taken from one of three transforms of the
+ * samples: the raw sample, the absolute first difference (the default), or
+ * the absolute second difference.  With SNDEGD_XFORM_AUTO, the context picks the transform for
+ * each channel and plane by itself; see sndegd_set_transform().
+ */
+
+#define SNDEGD_MAX_CHANNELS 2  /* channels beyond these are ignored */
+#define SNDEGD_PLANES 16
+
+/* sndegd_extract() never writes more than this per frame consumed. */
+#define SNDEGD_MAX_OUT_PER_FRAME (SNDEGD_MAX_CHANNELS * SNDEGD_PLANES * 2)
+
+enum sndegd_sample {
+    SNDEGD_S16_LE,
+    SNDEGD_S16_BE,
+};
+
+enum sndegd_xform {
+    SNDEGD_XFORM_RAW,
+    SNDEGD_XFORM_DIFF,
+    SNDEGD_XFORM_DIFF2,
+    SNDEGD_XFORMS,
+    SNDEGD_XFORM_AUTO = SNDEGD_XFORMS,
+};
+
+/*
+ * In SNDEGD_XFORM_AUTO mode, the first SNDEGD_EVAL_FRAMES of every
+ * SNDEGD_EVAL_PERIOD frames are run through all three transforms, and the
+ * von Neumann pairs that each plane of each would have produced are
+ * counted.  At the end of the window, a plane switches to the transform
+ * with the best yield that qualifies once that transform has beaten the
+ * current one by more than SNDEGD_EVAL_MARGIN percent, or replaced it
+ * after it stopped qualifying, in SNDEGD_EVAL_DWELL windows in a row, so
+ * that one noisy window does not switch it.  The one exception is falling
+ * back to the first difference, which happens at once when the current
+ * transform stops qualifying.  The counts are then halved, so that the
+ * decision rests on a decaying history of windows.
+ *
+ * To qualify, a transform's 01 and 10 pairs must be balanced, and the two
+ * bits of its pairs must be uncorrelated, so that a plane that follows a
+ * slow deterministic signal such as hum is not used.  The plane must also
+ * be uncorrelated with the next higher plane of the same transform, so that
+ * for example the sign extension of small raw samples or the carries
+ * around a DC offset are not whitened again in several planes.  The raw
+ * sample only qualifies for planes whose weight is at most a quarter of
+ * the mean absolute first difference, which stands in for the noise floor;
+ * the planes above it follow the signal.
+ *
+ * The planes as actually selected, which mix transforms, are also checked
+ * against each other pairwise over each window.  When two of them are
+ * correlated and at least one does not use the first difference, that one,
+ * or the higher of the two, falls back to the first difference, also at
+ * once.  Each of these tests allows SNDEGD_EVAL_MAX_Z standard deviations
+ * for the current transform, but only SNDEGD_EVAL_ENTER_Z for the others,
+ * so that a plane that is borderline under two transforms settles on one.
+ */
+#define SNDEGD_EVAL_FRAMES 4096
+#define SNDEGD_EVAL_PERIOD 65536
+#define SNDEGD_EVAL_MAX_Z 4.0
+#define SNDEGD_EVAL_ENTER_Z 2.0
+#define SNDEGD_EVAL_MARGIN 2
+#define SNDEGD_EVAL_DWELL 4
+
+struct sndegd_format {
+    enum sndegd_sample sample;
+    unsigned channels;          /* interleaved channels per frame */
+};
+
+/* Per-channel whitening state; one von Neumann stream per bit plane. */
+typedef struct {
+    int bits_out[16];
+    signed char prev_bits[16];
+    unsigned char byte_out[16];
+    int amls_bits_out[2][16];
+    signed char amls_bits[2][16];
+    unsigned char amls_byte_out[2][16];
+} vn_renorm_state_t;
+
+struct sndegd_ctx {
+    unsigned channel_lo, channel_hi;    /* channels [lo, hi) are used */
+    unsigned plane_lo, plane_hi;        /* bit planes [lo, hi) are used */
+    unsigned primed;                    /* frames in prev and prev2, up to 2 */
+    int prev[SNDEGD_MAX_CHANNELS];
+    int prev2[SNDEGD_MAX_CHANNELS];
+    /* Transform of each channel and plane, and the same as plane masks. */
+    enum sndegd_xform xform_mode;
+    unsigned char xform[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES];
+    uint16_t xform_mask[SNDEGD_MAX_CHANNELS][SNDEGD_XFORMS];
+    unsigned long xform_switches;
+    /* Transform that last beat the current one, and in how many windows
+     * in a row. */
+    unsigned char xform_want[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES];
+    unsigned char xform_dwell[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES];
+    /* SNDEGD_XFORM_AUTO evaluation state. */
+    unsigned eval_frame;
+    bool eval_half;
+    uint16_t eval_first[SNDEGD_MAX_CHANNELS][SNDEGD_XFORMS];
+    /* Pairs by value (first bit * 2 + second bit); 00 is eval_npairs less
+     * the others. */
+    unsigned eval_npairs;
+    unsigned eval_pairs[SNDEGD_MAX_CHANNELS][SNDEGD_XFORMS][SNDEGD_PLANES][4];
+    /* Frames, and how often each plane, and it and the plane above it,
+     * are set. */
+    unsigned eval_nframes;
+    unsigned eval_ones[SNDEGD_MAX_CHANNELS][SNDEGD_XFORMS][SNDEGD_PLANES];
+    unsigned eval_both[SNDEGD_MAX_CHANNELS][SNDEGD_XFORMS][SNDEGD_PLANES];
+    /* Sum of the absolute first differences over the same frames. */
+    unsigned long eval_absdiff[SNDEGD_MAX_CHANNELS];
+    /* How often each selected plane, and each pair of them (lower plane
+     * first), are set in the current window. */
+    unsigned eval_sel_ones[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES];
+    unsigned eval_sel_both[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES][SNDEGD_PLANES];
+    vn_renorm_state_t vn[SNDEGD_MAX_CHANNELS];
+    struct sndegd_stats *stats;         /* optional; see sndegd_set_stats() */
+};
+
+/*
+ * Count of each output byte value per channel and bit plane.  These are
+ * diagnostics rather than entropy, and at 32KB much larger than the rest of
+ * a context, so they live in a separate struct that the caller owns.
+ */
+struct sndegd_stats {
+    unsigned bytes[SNDEGD_MAX_CHANNELS][SNDEGD_PLANES][256];
+};
+
+void sndegd_init(struct sndegd_ctx *ctx);
+bool sndegd_set_planes(struct sndegd_ctx *ctx, unsigned channel_lo,
+                       unsigned channel_hi, unsigned plane_lo,
+                       unsigned plane_hi);
+void sndegd_set_transform(struct sndegd_ctx *ctx, enum sndegd_xform xform);
+void sndegd_set_stats(struct sndegd_ctx *ctx, struct sndegd_stats *stats);
+void sndegd_reset(struct sndegd_ctx *ctx);
+void sndegd_discontinuity(struct sndegd_ctx *ctx);
+size_t sndegd_frame_size(const struct sndegd_format *fmt);
+const char *sndegd_xform_name(enum sndegd_xform xform);
+size_t sndegd_extract(struct sndegd_ctx *ctx, const void *pcm, size_t frames,
+                      const struct sndegd_format *fmt, unsigned char *out,
+                      size_t outlen, size_t *consumed);
+double sndegd_mcv_min_entropy(unsigned long long max, unsigned long long n);
+
+#endif
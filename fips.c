@@ -0,0 +1,354 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * FIPS 140-2 continuous tests (monobit, poker, runs, and long run) on every
+ * 20000-bit block of extractor output, as done by rngtest.
+ *
+ * A block has to be held back until it is complete, since a failing block is
+ * dropped as a whole, so extracted bytes are gathered into a single block
+ * buffer on their way to the ring buffer.  The statistics are accumulated as
+ * the bytes are copied in rather than in a second pass over the finished
+ * block: ones are counted with a 64-bit popcount, and runs are walked one run
+ * at a time by finding the next bit that differs with a count of trailing
+ * zeros, so only the poker test looks at every nibble.  Bits are taken
+ * least significant first, which is the order the extractor produces them.
+ *
+ * fips_init() runs a known-answer self-test first: the statistics of a fixed
+ * block, and the verdict on statistics either side of every bound.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "arena.h"
+#include "fips.h"
+
+extern bool gflags_debug;
+
+#define FIPS_MAX_RUN 26 /* a run this long fails the long run test */
+
+enum {
+    FIPS_MONOBIT = 1,
+    FIPS_POKER = 2,
+    FIPS_RUNS = 4,
+    FIPS_LONG_RUN = 8,
+};
+
+/* Acceptable counts of runs of length 1-5 and 6+, for either bit value. */
+static const unsigned run_min[6] = { 2315, 1114, 527, 240, 103, 103 };
+static const unsigned run_max[6] = { 2685, 1386, 723, 384, 209, 209 };
+
+static bool enabled;
+static unsigned char *block; /* in the secure arena */
+static size_t block_len;
+/* Bytes of a passed block that did not fit into the ring buffer yet. */
+static size_t pending_off, pending_len;
+
+static unsigned ones;
+static unsigned poker[16];
+static unsigned runs[2][6];
+static unsigned cur_bit, cur_run, longest_run;
+
+static unsigned long long blocks, failed;
+static unsigned long long fail_monobit, fail_poker, fail_runs, fail_long_run;
+
+void fips_enable(void)
+{
+    enabled = true;
+}
+
+bool fips_enabled(void)
+{
+    return enabled;
+}
+
+size_t fips_arena_size(void)
+{
+    return enabled ? ARENA_SIZE(FIPS_BLOCK_BYTES) : 0;
+}
+
+static void fips_selftest(void);
+
+void fips_init(void)
+{
+    if (!enabled)
+        return;
+    block = arena_alloc(FIPS_BLOCK_BYTES);
+    fips_selftest();
+}
+
+static void fips_reset(void)
+{
+    ones = 0;
+    memset(poker, 0, sizeof poker);
+    memset(runs, 0, sizeof runs);
+    cur_run = 0;
+    longest_run = 0;
+    block_len = 0;
+}
+
+static inline void end_run(void)
+{
+    runs[cur_bit][MIN(cur_run, 6) - 1]++;
+    longest_run = MAX(longest_run, cur_run);
+}
+
+/* Accumulates the low n bits of x, 1 <= n <= 64. */
+static inline void fips_bits(uint64_t x, unsigned n)
+{
+    uint64_t mask = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+
+    x &= mask;
+    ones += (unsigned)__builtin_popcountll(x);
+    if (!cur_run)
+        cur_bit = x & 1;
+    for (;;) {
+        /* Set bits are the ones that end the current run. */
+        uint64_t d = (cur_bit ? ~x : x) & mask;
+        if (!d) {
+            cur_run += n;
+            return;
+        }
+        unsigned k = (unsigned)__builtin_ctzll(d);
+        cur_run += k;
+        end_run();
+        cur_bit ^= 1;
+        cur_run = 0;
+        x >>= k;
+        mask >>= k;
+        n -= k;
+    }
+}
+
+static inline void fips_poker(unsigned char b)
+{
+    poker[b & 0xf]++;
+    poker[b >> 4]++;
+}
+
+static void fips_update(const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x;
+        memcpy(&x, b + i, sizeof x);
+#ifdef HOST_ENDIAN_BE
+        x = __builtin_bswap64(x);
+#endif
+        fips_bits(x, 64);
+        for (size_t j = 0; j < 8; ++j)
+            fips_poker(b[i + j]);
+    }
+    for (; i < len; ++i) {
+        fips_bits(b[i], 8);
+        fips_poker(b[i]);
+    }
+}
+
+static unsigned long long poker_squares(void)
+{
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < 16; ++i)
+        sum += (unsigned long long)poker[i] * poker[i];
+    return sum;
+}
+
+/* @return the tests that the statistics of a completed block fail */
+static unsigned fips_verdict(void)
+{
+    unsigned r = 0;
+
+    if (ones <= 9725 || ones >= 10275)
+        r |= FIPS_MONOBIT;
+
+    /* X = 16/5000 * sum(f_i^2) - 5000 must lie in (2.16, 46.17); scaled
+     * by 5000/16 to stay in integers. */
+    unsigned long long sum = poker_squares();
+    if (sum * 16 <= 25000000ull + 10800ull || sum * 16 >= 25000000ull + 230850ull)
+        r |= FIPS_POKER;
+
+    for (size_t i = 0; i < 6; ++i) {
+        for (size_t v = 0; v < 2; ++v) {
+            if (runs[v][i] < run_min[i] || runs[v][i] > run_max[i])
+                r |= FIPS_RUNS;
+        }
+    }
+
+    if (longest_run >= FIPS_MAX_RUN)
+        r |= FIPS_LONG_RUN;
+    return r;
+}
+
+/* @return true if the completed block passes every test */
+static bool fips_judge(void)
+{
+    end_run();
+    ++blocks;
+
+    unsigned r = fips_verdict();
+    if (r & FIPS_MONOBIT)
+        ++fail_monobit;
+    if (r & FIPS_POKER)
+        ++fail_poker;
+    if (r & FIPS_RUNS)
+        ++fail_runs;
+    if (r & FIPS_LONG_RUN)
+        ++fail_long_run;
+    if (r) {
+        ++failed;
+        if (gflags_debug) log_line("fips: block %llu failed and was dropped\n", blocks);
+    }
+    return !r;
+}
+
+/*
+ * The statistics of a block of splitmix64 output started from 1, each word
+ * stored least significant byte first, as worked out bit by bit.
+ */
+static const struct {
+    unsigned ones;
+    unsigned long long poker_squares;
+    unsigned runs[2][6];
+    unsigned longest_run;
+} kat_block = {
+    .ones = 9966,
+    .poker_squares = 1567218,
+    .runs = { { 2532, 1239, 587, 333, 163, 161 },
+              { 2535, 1262, 616, 321, 122, 159 } },
+    .longest_run = 14,
+};
+
+/* Nibble counts with X just outside, just inside, just inside, and just
+ * outside the poker bounds. */
+static const unsigned kat_poker[4][16] = {
+    { 309, 308, 314, 310, 308, 311, 316, 308, 307, 306, 311, 320, 318, 315, 332, 307 },
+    { 308, 318, 310, 315, 309, 320, 318, 306, 307, 315, 315, 316, 320, 319, 309, 295 },
+    { 322, 287, 332, 284, 307, 328, 317, 338, 307, 316, 318, 285, 307, 301, 397, 254 },
+    { 301, 286, 295, 284, 332, 313, 317, 312, 286, 308, 288, 332, 307, 324, 413, 302 },
+};
+static const unsigned kat_poker_fails[4] = { FIPS_POKER, 0, 0, FIPS_POKER };
+
+/* One statistic set either side of a bound, with everything else passing. */
+static const struct {
+    unsigned *stat;
+    unsigned value;
+    unsigned fails;
+} kat_bounds[] = {
+    { &ones, 9725, FIPS_MONOBIT },
+    { &ones, 9726, 0 },
+    { &ones, 10274, 0 },
+    { &ones, 10275, FIPS_MONOBIT },
+    { &runs[0][0], 2314, FIPS_RUNS },
+    { &runs[0][0], 2315, 0 },
+    { &runs[1][0], 2685, 0 },
+    { &runs[1][0], 2686, FIPS_RUNS },
+    { &runs[1][5], 102, FIPS_RUNS },
+    { &runs[1][5], 103, 0 },
+    { &runs[0][5], 209, 0 },
+    { &runs[0][5], 210, FIPS_RUNS },
+    { &longest_run, 25, 0 },
+    { &longest_run, 26, FIPS_LONG_RUN },
+};
+
+/* Statistics that pass every test: those of kat_block, nudged to the middle. */
+static void kat_passing(void)
+{
+    ones = 10000;
+    memcpy(poker, kat_poker[1], sizeof poker);
+    memcpy(runs, kat_block.runs, sizeof runs);
+    longest_run = kat_block.longest_run;
+}
+
+static void fips_selftest(void)
+{
+    /* Fed in uneven pieces, to cover both the word and the byte paths. */
+    uint64_t x = 1;
+    for (size_t i = 0; i < FIPS_BLOCK_BYTES; i += 8) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        for (size_t k = 0; k < 8 && i + k < FIPS_BLOCK_BYTES; ++k)
+            block[i + k] = (unsigned char)(z >> 8 * k);
+    }
+    fips_reset();
+    for (size_t off = 0, n = 1; off < FIPS_BLOCK_BYTES; off += n, n = n * 3 % 37 + 1)
+        fips_update(block + off, MIN(n, FIPS_BLOCK_BYTES - off));
+    end_run();
+    if (ones != kat_block.ones || poker_squares() != kat_block.poker_squares
+        || memcmp(runs, kat_block.runs, sizeof runs)
+        || longest_run != kat_block.longest_run || fips_verdict())
+        suicide("fips: self-test failed: wrong statistics for the known block\n");
+
+    for (size_t i = 0; i < 4; ++i) {
+        kat_passing();
+        memcpy(poker, kat_poker[i], sizeof poker);
+        if (fips_verdict() != kat_poker_fails[i])
+            suicide("fips: self-test failed: poker bound %zu\n", i);
+    }
+    for (size_t i = 0; i < sizeof kat_bounds / sizeof kat_bounds[0]; ++i) {
+        kat_passing();
+        *kat_bounds[i].stat = kat_bounds[i].value;
+        if (fips_verdict() != kat_bounds[i].fails)
+            suicide("fips: self-test failed: bound %zu\n", i);
+    }
+    fips_reset();
+    if (gflags_debug) log_line("fips: self-test passed\n");
+}
+
+/*
+ * Moves as much of a passed block into the ring buffer as will fit.
+ * @return number of bytes stored in the ring buffer
+ */
+unsigned fips_flush(ring_buffer_t *rb)
+{
+    if (!pending_len)
+        return 0;
+    unsigned n = rb_store_block_xor(rb, block + pending_off, (unsigned)pending_len);
+    pending_off += n;
+    pending_len -= n;
+    if (!pending_len)
+        fips_reset();
+    return n;
+}
+
+/*
+ * Takes extracted bytes in place of rb_store_block_xor().  Input is only
+ * refused while a passed block is still waiting for room in the ring buffer,
+ * which is to say while the ring buffer is full; *used is set to the number
+ * of bytes that were taken, so that the caller can offer the rest again.
+ * @return number of bytes stored in the ring buffer
+ */
+unsigned fips_store(ring_buffer_t *rb, const unsigned char *b, unsigned len,
+                    unsigned *used)
+{
+    unsigned stored = fips_flush(rb), total = len;
+
+    while (len && !pending_len) {
+        size_t n = MIN(len, FIPS_BLOCK_BYTES - block_len);
+        memcpy(block + block_len, b, n);
+        fips_update(b, n);
+        block_len += n;
+        b += n;
+        len -= (unsigned)n;
+        if (block_len < FIPS_BLOCK_BYTES)
+            break;
+        if (fips_judge()) {
+            pending_off = 0;
+            pending_len = FIPS_BLOCK_BYTES;
+            stored += fips_flush(rb);
+        } else
+            fips_reset();
+    }
+    *used = total - len;
+    return stored;
+}
+
+void fips_print_stats(void)
+{
+    if (!enabled)
+        return;
+    log_line("fips: %llu blocks tested, %llu failed (monobit %llu, poker %llu, runs %llu, long run %llu)\n",
+             blocks, failed, fail_monobit, fail_poker, fail_runs, fail_long_run);
+}
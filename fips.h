@@ -0,0 +1,22 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_FIPS_H_
+#define NJK_FIPS_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include "rb.h"
+
+/* FIPS 140-2 tests are applied to blocks of this many bits. */
+#define FIPS_BLOCK_BITS 20000
+#define FIPS_BLOCK_BYTES (FIPS_BLOCK_BITS / 8)
+
+void fips_enable(void);
+bool fips_enabled(void);
+size_t fips_arena_size(void);
+void fips_init(void);
+unsigned fips_flush(ring_buffer_t *rb);
+unsigned fips_store(ring_buffer_t *rb, const unsigned char *b, unsigned len,
+                    unsigned *used);
+void fips_print_stats(void);
+
+#endif
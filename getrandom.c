@@ -2,23 +2,244 @@
 // SPDX-License-Identifier: MIT
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <sys/eventfd.h>
 #include "nk/log.h"
 #include "rb.h"
 #include "sound.h"
 #include "getrandom.h"
+#include "agc.h"
+#include "rt.h"
+#include "arena.h"
+#include "fips.h"
+#include "extract.h"
+#include "record.h"
+#include "trace.h"
+#include "toeplitz.h"
 
-extern ring_buffer_t rb;
+extern ring_buffer_t *rb;
 extern bool gflags_debug;
 
-/* Global for speed... */
-static struct frame_t vnbuf[PAGE_SIZE / sizeof(struct frame_t)];
-static vn_renorm_state_t vnstate[2];
-static unsigned int stats[2][16][256];
+#define MAX_WORKERS 32
+#define SHARD_SIZE RB_SIZE
+#define STAGE_SIZE 512
 
-void vn_buf_lock(void)
+/* Global for speed...  The buffers live in the secure arena. */
+static struct frame_t *vnbuf;
+static unsigned char *stage;
+/* Bytes [off, len) of stage are extracted but not yet committed. */
+static struct {
+    size_t off, len;
+} staged;
+/* Keep capturing between calls to get_random_data() rather than pausing. */
+static bool continuous;
+/* Extractor contexts; one per worker, and only vnctx[0] without workers. */
+static struct sndegd_ctx *vnctx[MAX_WORKERS];
+static struct sndegd_stats *vnstats[MAX_WORKERS];
+static size_t nctx = 1;
+static struct sndegd_format pcm_fmt = { .sample = SNDEGD_S16_LE, .channels = 2 };
+static enum sndegd_xform xform_mode = SNDEGD_XFORM_DIFF;
+/* Frames asked of each sound_read(); 0 means one capture period. */
+static size_t read_frames;
+
+/*
+ * The captured frames are whitened as one unbroken stream.  The extractor
+ * state, including the last frame that the deltas are taken against, is
+ * kept from one read and one refill to the next, and when the ring buffer
+ * fills part way through a read the rest of vnbuf is held for the next
+ * refill rather than dropped.  Only a real gap in the capture, when it
+ * was paused or overran, breaks the stream, and then gap is set so that
+ * the frames read next are not paired with the ones before.
+ */
+static struct {
+    size_t frames;      /* frames in vnbuf */
+    size_t off;         /* of which this many have been extracted */
+    bool gap;
+    unsigned long long read, extracted, out, gaps;
+} stream;
+
+/*
+ * Optional Toeplitz hash extractor, used instead of the von Neumann
+ * extractor when toeplitz_ratio is set.  It hashes the captured frames as
+ * they are, so the transforms and the workers do not apply.
+ */
+static unsigned toeplitz_ratio;
+static struct toeplitz *tz;
+
+/*
+ * The hash is only sound if every block holds well over the 256 bits that
+ * come out of it, so the raw samples of the first TZ_CHECK_FRAMES frames
+ * are counted, and the ratio is checked against the same most common value
+ * estimate of their min-entropy that snd-egd-analyze reports.  That is an
+ * upper bound for samples that are correlated, so passing is no guarantee.
+ */
+#define TZ_CHECK_FRAMES (1u << 20)
+#define TZ_MARGIN_BITS 128
+static struct {
+    unsigned (*hist)[65536];
+    size_t frames;
+} tzcheck;
+
+/*
+ * CPU budget, as a fraction of one core; 0 means unlimited.  Within a
+ * refill, whenever the CPU time that this process has used exceeds the
+ * budget times the wall time elapsed, capture is paused and the extractor
+ * sleeps until the two are back in line.  The clock covers every thread of
+ * the process, so worker threads count against the budget too.
+ */
+#define THROTTLE_MIN_NS 1000000L
+#define THROTTLE_MAX_NS 100000000L
+static double cpu_budget;
+static struct {
+    unsigned long refills, capped, sleeps;
+    double slept, cpu, wall;
+} throttle;
+
+/*
+ * Background extractor for the kernel feeder.  The feeder asks for a refill
+ * through request_fd and the extractor thread fills the ring buffer,
+ * bumping progress_fd every time it has committed more output, so that the
+ * feeder can credit the kernel as data arrives and otherwise sleep in poll()
+ * instead of spinning on an empty ring buffer.  Both are eventfds, so
+ * repeated requests or progress notes coalesce.
+ *
+ * The extractor is either a thread of this process or, with privilege
+ * separation, the main thread of a forked capture process that shares the
+ * eventfds and the ring buffer with the feeder.
+ */
+static struct {
+    pthread_t tid;
+    int request_fd;
+    int progress_fd;
+    atomic_bool stop;
+    bool running;
+    unsigned long waits;
+} extractor = {
+    .request_fd = -1,
+    .progress_fd = -1,
+};
+
+/* Frames asked of each sound_read(). */
+size_t vn_read_frames(void)
+{
+    return read_frames ? read_frames
+        : MIN(MAX_PERIOD_FRAMES, sound_period_frames());
+}
+
+static size_t vn_buf_frames(void)
+{
+    return MAX(read_frames, MAX_PERIOD_FRAMES);
+}
+
+/* Arena space needed by vn_buf_init() and vn_workers_start(workers). */
+size_t vn_arena_size(unsigned workers)
+{
+    size_t r = ARENA_SIZE(vn_buf_frames() * sizeof *vnbuf)
+             + ARENA_SIZE(sizeof **vnctx)
+             + ARENA_SIZE(STAGE_SIZE);
+    if (toeplitz_ratio)
+        return r + ARENA_SIZE(sizeof *tz);
+    if (workers > 1) {
+        size_t n = MIN(workers, MAX_WORKERS);
+        r += (n - 1) * ARENA_SIZE(sizeof **vnctx) + n * ARENA_SIZE(SHARD_SIZE);
+    }
+    return r;
+}
+
+/*
+ * Sets up extractor context k.  Only the context is entropy; its output
+ * statistics are kept out of the arena so that they are not locked.
+ */
+static void vn_ctx_init(size_t k)
+{
+    vnctx[k] = arena_alloc(sizeof **vnctx);
+    sndegd_init(vnctx[k]);
+    sndegd_set_transform(vnctx[k], xform_mode);
+    vnstats[k] = calloc(1, sizeof **vnstats);
+    if (!vnstats[k])
+        suicide("could not allocate extractor statistics\n");
+    sndegd_set_stats(vnctx[k], vnstats[k]);
+}
+
+void vn_buf_init(void)
+{
+    vnbuf = arena_alloc(vn_buf_frames() * sizeof *vnbuf);
+    vn_ctx_init(0);
+    stage = arena_alloc(STAGE_SIZE);
+    if (toeplitz_ratio) {
+        tz = arena_alloc(sizeof *tz);
+        const char *src = toeplitz_init(tz, toeplitz_ratio);
+        log_line("toeplitz extractor: %u input bits per output bit, %s, seed: %s\n",
+                 toeplitz_ratio, toeplitz_accelerated() ? "pclmul" : "portable", src);
+        tzcheck.hist = calloc(SNDEGD_MAX_CHANNELS, sizeof *tzcheck.hist);
+        if (!tzcheck.hist)
+            suicide("could not allocate the toeplitz entropy check\n");
+    }
+}
+
+void vn_set_continuous(bool on)
+{
+    continuous = on;
+}
+
+void vn_set_read_size(unsigned frames)
+{
+    read_frames = frames;
+}
+
+void vn_set_transform(enum sndegd_xform xform)
+{
+    xform_mode = xform;
+}
+
+void vn_set_cpu_budget(double fraction)
+{
+    cpu_budget = fraction;
+}
+
+/* Must be called before vn_arena_size(); 0 selects von Neumann. */
+void vn_set_toeplitz(unsigned ratio)
+{
+    toeplitz_ratio = ratio;
+}
+
+/* Every context only counts the planes that it covers, so they just add. */
+static unsigned vn_stat(size_t c, size_t j, size_t b)
 {
-    mlock(vnbuf, sizeof vnbuf);
-    mlock(vnstate, sizeof vnstate);
+    unsigned r = 0;
+    for (size_t k = 0; k < nctx; ++k)
+        r += vnstats[k]->bytes[c][j][b];
+    return r;
+}
+
+/* The transform of each plane is only known to the context that covers it. */
+static void print_transforms(void)
+{
+    static const char code[SNDEGD_XFORMS] = { 'r', '1', '2' };
+    unsigned long switches = 0;
+
+    for (size_t k = 0; k < nctx; ++k)
+        switches += vnctx[k]->xform_switches;
+    log_line("transforms (%s), planes 1-16, r = raw, 1 = diff, 2 = diff2; %lu switches\n",
+             sndegd_xform_name(xform_mode), switches);
+    for (size_t c = 0; c < 2; ++c) {
+        char line[SNDEGD_PLANES + 1] = { 0 };
+        for (size_t k = 0; k < nctx; ++k) {
+            const struct sndegd_ctx *x = vnctx[k];
+            if (c < x->channel_lo || c >= x->channel_hi)
+                continue;
+            for (size_t j = x->plane_lo; j < x->plane_hi; ++j)
+                line[j] = code[x->xform[c][j]];
+        }
+        log_line("%s:\t %s\n", c ? "RIGHT" : "LEFT", line);
+    }
 }
 
 void print_random_stats(void)
@@ -27,202 +248,602 @@ void print_random_stats(void)
     if (gflags_debug) log_line("byte:\t 1\t 2\t 3\t 4\t 5\t 6\t 7\t 8\n");
     for (size_t i = 0; i < 256; ++i) {
         if (gflags_debug) log_line("%zu:\t %u\t %u\t %u\t %u\t %u\t %u\t %u\t %u\n", i,
-                  stats[0][0][i], stats[0][1][i], stats[0][2][i],
-                  stats[0][3][i], stats[0][4][i], stats[0][5][i],
-                  stats[0][6][i], stats[0][7][i]);
+                  vn_stat(0, 0, i), vn_stat(0, 1, i), vn_stat(0, 2, i),
+                  vn_stat(0, 3, i), vn_stat(0, 4, i), vn_stat(0, 5, i),
+                  vn_stat(0, 6, i), vn_stat(0, 7, i));
     }
     if (gflags_debug) log_line("byte:\t 9\t 10\t 11\t 12\t 13\t 14\t 15\t 16\n");
     for (size_t i = 0; i < 256; ++i) {
         if (gflags_debug) log_line("%zu:\t %u\t %u\t %u\t %u\t %u\t %u\t %u\t %u\n", i,
-                  stats[0][8][i], stats[0][9][i], stats[0][10][i],
-                  stats[0][11][i], stats[0][12][i], stats[0][13][i],
-                  stats[0][14][i], stats[0][15][i]);
+                  vn_stat(0, 8, i), vn_stat(0, 9, i), vn_stat(0, 10, i),
+                  vn_stat(0, 11, i), vn_stat(0, 12, i), vn_stat(0, 13, i),
+                  vn_stat(0, 14, i), vn_stat(0, 15, i));
     }
     if (gflags_debug) log_line("RIGHT sampled random character counts:\n");
     if (gflags_debug) log_line("byte:\t 1\t 2\t 3\t 4\t 5\t 6\t 7\t 8\t\n");
     for (size_t i = 0; i < 256; ++i) {
         if (gflags_debug) log_line("%zu:\t %u\t %u\t %u\t %u\t %u\t %u\t %u\t %u\n", i,
-                  stats[1][0][i], stats[1][1][i], stats[1][2][i],
-                  stats[1][3][i], stats[1][4][i], stats[1][5][i],
-                  stats[1][6][i], stats[1][7][i]);
+                  vn_stat(1, 0, i), vn_stat(1, 1, i), vn_stat(1, 2, i),
+                  vn_stat(1, 3, i), vn_stat(1, 4, i), vn_stat(1, 5, i),
+                  vn_stat(1, 6, i), vn_stat(1, 7, i));
     }
     if (gflags_debug) log_line("byte:\t 9\t 10\t 11\t 12\t 13\t 14\t 15\t 16\n");
     for (size_t i = 0; i < 256; ++i) {
         if (gflags_debug) log_line("%zu:\t %u\t %u\t %u\t %u\t %u\t %u\t %u\t %u\n", i,
-                  stats[1][8][i], stats[1][9][i], stats[1][10][i],
-                  stats[1][11][i], stats[1][12][i], stats[1][13][i],
-                  stats[1][14][i], stats[1][15][i]);
+                  vn_stat(1, 8, i), vn_stat(1, 9, i), vn_stat(1, 10, i),
+                  vn_stat(1, 11, i), vn_stat(1, 12, i), vn_stat(1, 13, i),
+                  vn_stat(1, 14, i), vn_stat(1, 15, i));
     }
     if (gflags_debug) log_line("total random character counts:\n");
     for (size_t i = 0; i < 256; ++i) {
         unsigned outl = 0, outr = 0;
-        for (int j = 0; j < 16; ++j) {
-            outl += stats[0][j][i];
-            outr += stats[1][j][i];
+        for (size_t j = 0; j < 16; ++j) {
+            outl += vn_stat(0, j, i);
+            outr += vn_stat(1, j, i);
         }
         if (gflags_debug) log_line("%zu:\t %u\t %u\n", i, outl, outr);
     }
+    if (gflags_debug && tz)
+        log_line("toeplitz: %llu blocks of %u bytes hashed\n", tz->blocks,
+                 TOEPLITZ_OUT_BYTES * toeplitz_ratio);
+    if (gflags_debug) log_line("capture: %llu frames read, %llu extracted, %zu held, %llu gaps\n",
+                               stream.read, stream.extracted, stream.frames - stream.off,
+                               stream.gaps);
+    if (gflags_debug && stream.extracted)
+        log_line("capture: in->out bytes = %llu->%llu, eff = %f\n",
+                 stream.extracted * sizeof *vnbuf, stream.out,
+                 (double)stream.out / (double)(stream.extracted * sizeof *vnbuf));
+    if (gflags_debug) log_line("capture xruns: %lu\n", sound_xruns());
+    rt_print_stats();
+    if (gflags_debug) sound_print_stats();
+    if (gflags_debug) print_transforms();
+    if (gflags_debug && cpu_budget > 0.0) {
+        log_line("cpu budget %.1f%%: used %.1f%% over %.1fs of refills\n",
+                 100.0 * cpu_budget,
+                 throttle.wall > 0.0 ? 100.0 * throttle.cpu / throttle.wall : 0.0,
+                 throttle.wall);
+        log_line("cpu budget capped %lu of %lu refills; capture paused %lu times for %.3fs\n",
+                 throttle.capped, throttle.refills, throttle.sleeps, throttle.slept);
+    }
+    if (gflags_debug) agc_print_stats();
+    if (gflags_debug) fips_print_stats();
 }
 
-static void vn_renorm_init(void)
+static void vn_discontinuity(void)
 {
-    for (size_t i = 0; i < 2; ++i) {
-        vnstate[i].total_out = 0;
-        for (size_t j = 0; j < 16; ++j) {
-            vnstate[i].bits_out[j] = 0;
-            vnstate[i].byte_out[j] = 0;
-            vnstate[i].prev_bits[j] = -1;
-        }
-    }
+    for (size_t k = 0; k < nctx; ++k)
+        sndegd_discontinuity(vnctx[k]);
 }
 
-static size_t buf_to_deltabuf(size_t frames)
+/* Warns, once enough frames are in, if the ratio asks more of them than they have. */
+static void tz_check(size_t frames)
 {
-    if (frames < 2)
-        return 0;
+    for (size_t i = 0; i < frames; ++i) {
+        for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c)
+            ++tzcheck.hist[c][(uint16_t)vnbuf[i].channel[c]];
+    }
+    tzcheck.frames += frames;
+    if (tzcheck.frames < TZ_CHECK_FRAMES)
+        return;
 
-    for (size_t i = 0; i < frames - 1; ++i) {
-        vnbuf[i].channel[0] = abs(vnbuf[i+1].channel[0] - vnbuf[i].channel[0]);
-        vnbuf[i].channel[1] = abs(vnbuf[i+1].channel[1] - vnbuf[i].channel[1]);
+    double h = 0.0;
+    for (size_t c = 0; c < SNDEGD_MAX_CHANNELS; ++c) {
+        unsigned max = 0;
+        for (size_t v = 0; v < 65536; ++v)
+            max = MAX(max, tzcheck.hist[c][v]);
+        h += sndegd_mcv_min_entropy(max, tzcheck.frames);
     }
+    /* A block is 8 * ratio frames. */
+    double need = TOEPLITZ_OUT_BYTES * 8 + TZ_MARGIN_BITS;
+    if (h * 8.0 * toeplitz_ratio < need) {
+        double min = h > 0.0 ? ceil(need / (8.0 * h)) : INFINITY;
+        if (min <= TOEPLITZ_MAX_RATIO)
+            log_line("toeplitz: raw min-entropy is at most %.2f bits per frame; ratio %u is too low for it, use at least %.0f\n",
+                     h, toeplitz_ratio, min);
+        else
+            log_line("toeplitz: raw min-entropy is at most %.2f bits per frame; no ratio is high enough for it\n",
+                     h);
+    } else if (gflags_debug)
+        log_line("toeplitz: raw min-entropy is at most %.2f bits per frame; ratio %u is enough\n",
+                 h, toeplitz_ratio);
+    free(tzcheck.hist);
+    tzcheck.hist = NULL;
+}
 
-    return frames - 1;
+/* Counts samples pinned at full scale; used to keep AGC out of clipping. */
+static size_t count_clipped(size_t frames)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < frames; ++i) {
+        for (size_t c = 0; c < 2; ++c)
+            n += vnbuf[i].channel[c] == INT16_MAX || vnbuf[i].channel[c] == INT16_MIN;
+    }
+    return n;
 }
 
-#ifdef USE_AMLS
-static int vn_renorm_amls(char new, size_t j, int channel, int diffbits)
+/*
+ * Commits bytes [*off, len) of b to the ring buffer, through the FIPS tests
+ * if enabled, and advances *off past the bytes that were taken.  Whatever
+ * is not taken because the ring buffer is full stays for the next call.
+ * @return number of bytes that were added to the entropy buffer
+ */
+static unsigned int vn_commit(const unsigned char *b, size_t *off, size_t len)
 {
-    // No previous bit pairs is stored
-    if (vnstate[channel].amls_bits[diffbits][j] == -1) {
-        vnstate[channel].amls_bits[diffbits][j] = new;
+    unsigned used, stored;
+
+    if (*off >= len)
         return 0;
+    if (fips_enabled())
+        stored = fips_store(rb, b + *off, (unsigned)(len - *off), &used);
+    else
+        used = stored = rb_store_block_xor(rb, b + *off, (unsigned)(len - *off));
+    *off += used;
+    return stored;
+}
+
+/*
+ * Extracted bytes are staged in a small buffer and committed to the ring
+ * buffer in blocks rather than being stored one at a time.  The stage is
+ * limited to the free space in the ring buffer, so extraction stops about
+ * when the ring buffer fills and the rest of vnbuf is left for later; the
+ * few bytes of the last block that did not fit stay staged until there is
+ * room.
+ * @return number of bytes that were added to the entropy buffer
+ */
+static unsigned int extract_serial(void)
+{
+    unsigned int stored = vn_commit(stage, &staged.off, staged.len);
+
+    while (staged.off == staged.len && stream.off < stream.frames) {
+        size_t n, cap = MIN(STAGE_SIZE, rb_num_free(rb) + SNDEGD_MAX_OUT_PER_FRAME - 1);
+        staged.off = 0;
+        staged.len = sndegd_extract(vnctx[0], vnbuf + stream.off, stream.frames - stream.off,
+                                    &pcm_fmt, stage, cap, &n);
+        stream.off += n;
+        stored += vn_commit(stage, &staged.off, staged.len);
+        if (rb_is_full(rb))
+            break;
     }
+    return stored;
+}
 
-    // If this bit pair != previous bit pair, store a bit
-    if (vnstate[channel].amls_bits[diffbits][j] == new) {
-        vnstate[channel].amls_bits[diffbits][j] = -1;
-        return 0;
+/*
+ * As extract_serial(), but through the Toeplitz hash.  Blocks are a whole
+ * number of frames, so the input is always consumed in whole frames.
+ */
+static unsigned int extract_toeplitz(void)
+{
+    const unsigned char *in = (const unsigned char *)vnbuf;
+    size_t len = stream.frames * sizeof *vnbuf, off = stream.off * sizeof *vnbuf;
+    unsigned int stored = vn_commit(stage, &staged.off, staged.len);
+
+    while (staged.off == staged.len && off < len) {
+        size_t n, cap = MIN(STAGE_SIZE, rb_num_free(rb) + TOEPLITZ_OUT_BYTES - 1);
+        staged.off = 0;
+        staged.len = toeplitz_absorb(tz, in + off, len - off, stage, cap, &n);
+        off += n;
+        stored += vn_commit(stage, &staged.off, staged.len);
+        if (rb_is_full(rb) || (!staged.len && off < len))
+            break;
     }
+    stream.off = off / sizeof *vnbuf;
+    return stored;
+}
+
+/*
+ * Optional pool of extraction workers.  The bit planes of each channel are
+ * divided among the tasks; task 0 is run by the calling thread and the rest
+ * each have a dedicated thread.  Every task has its own extractor context
+ * restricted to its planes and writes into its own shard, so the only
+ * synchronization is the start/finish handoff for each round.  The shards
+ * are merged into the ring buffer by the calling thread.  A task whose
+ * shard fills stops where it is and picks up from there in the next round.
+ * Each round's output is limited to about the free space in the ring
+ * buffer, split evenly among the tasks, and whatever of it still does not
+ * fit stays in the shards until there is room.
+ */
+struct vn_task {
+    struct sndegd_ctx *ctx;
+    unsigned char *shard;
+    size_t len;
+    size_t sent;        /* bytes of the shard already committed */
+    size_t off;         /* frames of vnbuf that this task has extracted */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    unsigned gen;
+    size_t frames;
+    size_t cap;
+    size_t ntasks;
+    size_t done;
+    struct vn_task task[MAX_WORKERS];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+    .ntasks = 1,
+};
+
+/* Runs one task over the read buffer until it is done or has cap bytes. */
+static void vn_task_run(struct vn_task *t, size_t frames, size_t cap)
+{
+    size_t used;
+    t->sent = 0;
+    t->len = sndegd_extract(t->ctx, vnbuf + t->off, frames - t->off, &pcm_fmt,
+                            t->shard, cap, &used);
+    t->off += used;
+}
+
+static void *vn_worker(void *arg)
+{
+    struct vn_task *t = arg;
+    unsigned gen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.gen == gen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        gen = pool.gen;
+        size_t frames = pool.frames, cap = pool.cap;
+        pthread_mutex_unlock(&pool.lock);
 
-    if (vnstate[channel].amls_bits[diffbits][j])
-        vnstate[channel].amls_byte_out[diffbits][j] |=
-            1 << vnstate[channel].amls_bits_out[diffbits][j];
-    vnstate[channel].amls_bits_out[diffbits][j]++;
-    vnstate[channel].amls_bits[diffbits][j] = -1;
+        vn_task_run(t, frames, cap);
 
-    /* See if we've collected an entire byte.  If so, then copy
-     * it into the output buffer. */
-    if (vnstate[channel].amls_bits_out[diffbits][j] == 8) {
-        stats[channel][j][vnstate[channel].amls_byte_out[diffbits][j]] += 1;
-        vnstate[channel].total_out +=
-            rb_store_byte_xor(&rb, vnstate[channel].amls_byte_out[diffbits][j]);
+        pthread_mutex_lock(&pool.lock);
+        if (++pool.done == pool.ntasks - 1)
+            pthread_cond_signal(&pool.finished);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+void vn_workers_start(unsigned n)
+{
+    if (n < 2)
+        return;
+    if (tz) {
+        log_line("workers are not used with the toeplitz extractor\n");
+        return;
+    }
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
 
-        vnstate[channel].amls_bits_out[diffbits][j] = 0;
-        vnstate[channel].amls_byte_out[diffbits][j] = 0;
+    /* Channel 0 gets the extra task if n is odd. */
+    size_t k = 0;
+    for (size_t c = 0; c < 2; ++c) {
+        size_t groups = c == 0 ? (n + 1) / 2 : n / 2;
+        for (size_t g = 0; g < groups; ++g, ++k) {
+            if (k)
+                vn_ctx_init(k);
+            sndegd_set_planes(vnctx[k], (unsigned)c, (unsigned)c + 1,
+                              (unsigned)(g * 16 / groups),
+                              (unsigned)((g + 1) * 16 / groups));
+            pool.task[k].ctx = vnctx[k];
+            pool.task[k].shard = arena_alloc(SHARD_SIZE);
+        }
+    }
+    pool.ntasks = n;
+    nctx = n;
 
-        if (rb_is_full(&rb))
-            return 1;
+    /* Signals are always handled by the main thread. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i = 1; i < n; ++i) {
+        pthread_t tid;
+        int r = pthread_create(&tid, NULL, vn_worker, &pool.task[i]);
+        if (r)
+            suicide("pthread_create failed: %s\n", strerror(r));
+        pthread_detach(tid);
     }
-    return 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (gflags_debug) log_line("started %u extraction workers\n", n);
 }
-#else
-static int vn_renorm_amls(char new, size_t j, int channel, int diffbits)
+
+/*
+ * Commits whatever extracted output is still waiting for room.
+ * @return number of bytes that were added to the entropy buffer
+ */
+static unsigned int vn_flush(void)
 {
-    return 0;
+    unsigned int stored = vn_commit(stage, &staged.off, staged.len);
+    for (size_t i = 0; i < pool.ntasks; ++i)
+        stored += vn_commit(pool.task[i].shard, &pool.task[i].sent, pool.task[i].len);
+    return stored;
 }
-#endif
 
 /*
- * We assume that the chance of a given bit in a sample being a 0 or 1 is not
- * equal.  It is thus a statistically unfair 'coin'.  We can nevertheless use
- * this sample as if it were a fair 'coin' if we use a special procedure:
- *
- * 1. Take a pair of bits of fixed significance in the output
- * 2. If 01, treat as a zero bit.
- * 3. If 10, treat as a one bit.
- * 4. Otherwise, discard as no result.
- *
+ * Runs rounds of the tasks until every one of them has extracted all of
+ * vnbuf or the ring buffer is full; stream.off is where the slowest is.
  * @return number of bytes that were added to the entropy buffer
  */
-static int vn_renorm(uint16_t i, size_t channel)
+static unsigned int extract_parallel(void)
 {
-    /* process bits */
-    for (size_t j = 0; j < 16; ++j) {
-        /* Select the bit of given significance. */
-        char new = (i >> j) & 0x01;
+    unsigned int stored = vn_flush();
+    bool held = false;
+
+    for (size_t i = 0; i < pool.ntasks; ++i)
+        held |= pool.task[i].sent < pool.task[i].len;
+    while (!held && stream.off < stream.frames) {
+        size_t cap = rb_num_free(rb) / pool.ntasks + SNDEGD_MAX_OUT_PER_FRAME;
+        pthread_mutex_lock(&pool.lock);
+        pool.frames = stream.frames;
+        pool.cap = MIN(cap, SHARD_SIZE);
+        pool.done = 0;
+        ++pool.gen;
+        pthread_cond_broadcast(&pool.start);
+        pthread_mutex_unlock(&pool.lock);
+
+        vn_task_run(&pool.task[0], stream.frames, pool.cap);
 
-        /* We've not yet collected two bits; move on. */
-        if (vnstate[channel].prev_bits[j] == -1) {
-            vnstate[channel].prev_bits[j] = new;
-            continue;
+        pthread_mutex_lock(&pool.lock);
+        while (pool.done < pool.ntasks - 1)
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        size_t off = stream.frames;
+        for (size_t i = 0; i < pool.ntasks; ++i) {
+            struct vn_task *t = &pool.task[i];
+            stored += vn_commit(t->shard, &t->sent, t->len);
+            held |= t->sent < t->len;
+            off = MIN(off, t->off);
         }
+        stream.off = off;
+        if (rb_is_full(rb))
+            break;
+    }
+    return stored;
+}
+
+/* Tops up the ring buffer for one request. */
+static void vn_extractor_fill(void)
+{
+    eventfd_t v;
+    eventfd_read(extractor.request_fd, &v);
+    if (!rb_is_full(rb))
+        get_random_data(rb_num_free(rb));
+}
 
-        /* If the bits are equal, discard both. */
-        if (vnstate[channel].prev_bits[j] == new) {
-            vnstate[channel].prev_bits[j] = -1;
-            if (vn_renorm_amls(new, j, channel, 0))
-                return 1;
-            continue;
+static void *vn_extractor(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        struct pollfd pfd = { .fd = extractor.request_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            suicide("extractor: poll failed: %s\n", strerror(errno));
         }
+        if (atomic_load(&extractor.stop))
+            break;
+        vn_extractor_fill();
+    }
+    return NULL;
+}
+
+/* Must be called before a capture process is forked, so that it shares them. */
+void vn_extractor_init(void)
+{
+    extractor.request_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    extractor.progress_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (extractor.request_fd < 0 || extractor.progress_fd < 0)
+        suicide("extractor: eventfd failed: %s\n", strerror(errno));
+}
+
+void vn_extractor_start(void)
+{
+    /* Signals are always handled by the main thread. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int r = pthread_create(&extractor.tid, NULL, vn_extractor, NULL);
+    if (r)
+        suicide("pthread_create failed: %s\n", strerror(r));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    extractor.running = true;
+}
 
-        /* If 10, mark the bit as 1.  Otherwise, it's 01 and the bit
-         * is already marked as 0. */
-        if (vnstate[channel].prev_bits[j])
-            vnstate[channel].byte_out[j] |= 1 << vnstate[channel].bits_out[j];
-        vnstate[channel].bits_out[j]++;
-        vnstate[channel].prev_bits[j] = -1;
-        if (vn_renorm_amls(new, j, channel, 1))
-            return 1;
-
-        /* See if we've collected an entire byte.  If so, then copy
-         * it into the output buffer. */
-        if (vnstate[channel].bits_out[j] == 8) {
-            stats[channel][j][vnstate[channel].byte_out[j]] += 1;
-            vnstate[channel].total_out +=
-                rb_store_byte_xor(&rb, vnstate[channel].byte_out[j]);
-
-            vnstate[channel].bits_out[j] = 0;
-            vnstate[channel].byte_out[j] = 0;
-
-            if (rb_is_full(&rb))
-                return 1;
+/*
+ * Serves requests on the calling thread; this is the whole job of a capture
+ * process.  Returns when interrupted by a signal, which the caller should
+ * handle before calling again.
+ */
+void vn_extractor_serve(void)
+{
+    for (;;) {
+        struct pollfd pfd = { .fd = extractor.request_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                return;
+            suicide("extractor: poll failed: %s\n", strerror(errno));
         }
+        vn_extractor_fill();
+    }
+}
+
+/* Waits for the extractor to finish what it is doing, then ends it. */
+void vn_extractor_stop(void)
+{
+    if (!extractor.running)
+        return;
+    atomic_store(&extractor.stop, true);
+    eventfd_write(extractor.request_fd, 1);
+    pthread_join(extractor.tid, NULL);
+    extractor.running = false;
+}
+
+/* Asks the extractor to top up the ring buffer; never blocks. */
+void vn_extractor_request(void)
+{
+    if (eventfd_write(extractor.request_fd, 1))
+        suicide("extractor: eventfd_write failed: %s\n", strerror(errno));
+}
+
+/*
+ * Sleeps until the extractor has committed more output.
+ * @return false if interrupted by a signal, which the caller should handle
+ */
+bool vn_extractor_wait(void)
+{
+    struct pollfd pfd = { .fd = extractor.progress_fd, .events = POLLIN };
+    uint64_t t0 = trace_now();
+
+    ++extractor.waits;
+    int r = poll(&pfd, 1, -1);
+    trace_event(TRACE_WAIT, (uint32_t)((trace_now() - t0) / 1000u), 0, 0, 0);
+    if (r < 0) {
+        if (errno == EINTR)
+            return false;
+        suicide("extractor: poll failed: %s\n", strerror(errno));
     }
-    return 0;
+    eventfd_t v;
+    eventfd_read(extractor.progress_fd, &v);
+    return true;
+}
+
+void vn_extractor_print_stats(void)
+{
+    if (gflags_debug && extractor.request_fd >= 0)
+        log_line("feeder waited for the extractor %lu times\n", extractor.waits);
+}
+
+static double ts_sub(const struct timespec *a, const struct timespec *b)
+{
+    return (double)(a->tv_sec - b->tv_sec) + (double)(a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/*
+ * Sleeps, with capture paused, for as long as the CPU time used since the
+ * start of the refill is over budget, but at most THROTTLE_MAX_NS at a time
+ * so that a stop request is still noticed promptly.
+ * @return true if it slept, in which case the captured stream has a gap
+ */
+static bool throttle_pace(const struct timespec *wall0, const struct timespec *cpu0,
+                          bool *capped)
+{
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    double ahead = ts_sub(&cpu, cpu0) / cpu_budget - ts_sub(&wall, wall0);
+    if (ahead * 1e9 < (double)THROTTLE_MIN_NS)
+        return false;
+
+    long ns = ahead * 1e9 > (double)THROTTLE_MAX_NS ? THROTTLE_MAX_NS : (long)(ahead * 1e9);
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = ns };
+    sound_stop();
+    while (nanosleep(&ts, &ts) && errno == EINTR && !atomic_load(&extractor.stop));
+    sound_start();
+    trace_event(TRACE_THROTTLE, (uint32_t)(ns / 1000), 0, 0, 0);
+    ++throttle.sleeps;
+    throttle.slept += (double)ns * 1e-9;
+    *capped = true;
+    return true;
 }
 
 /* target = desired bytes of entropy that should be retrieved */
 void get_random_data(unsigned target)
 {
     size_t total_in = 0, framesize = 0, total_out = 0, frames = 0;
-    vn_renorm_init();
+    size_t samples = 0, clipped = 0;
+    unsigned long xruns = sound_xruns(), failovers = sound_failovers();
+    struct timespec wall0, cpu0;
+    bool capped = false;
 
     if (gflags_debug) log_line("get_random_data(%u)\n", target);
+    trace_event(TRACE_REFILL, target, rb_num_bytes(rb), 0, 0);
 
-    target = MIN(sizeof vnbuf, target);
+    /* A passed FIPS block or extracted bytes may still be waiting for room. */
+    if (fips_enabled())
+        total_out += fips_flush(rb);
+    total_out += vn_flush();
+    stream.out += total_out;
 
+    if (cpu_budget > 0.0) {
+        clock_gettime(CLOCK_MONOTONIC, &wall0);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    }
     sound_start();
-    while (total_out < target) {
-        frames = sound_read(vnbuf, target);
-        framesize = sound_bytes_per_frame();
-        if (gflags_debug) log_line("frames = %zu\n", frames);
-
-        frames = buf_to_deltabuf(frames);
-
-        unsigned i;
-        for (i = 0; i < frames; ++i) {
-            if (vn_renorm((uint16_t)vnbuf[i].channel[0], 0))
-                break;
-            if (vn_renorm((uint16_t)vnbuf[i].channel[1], 1))
-                break;
+    framesize = sound_bytes_per_frame();
+    pcm_fmt.sample = sound_is_be() ? SNDEGD_S16_BE : SNDEGD_S16_LE;
+    /* Read a whole period at a time rather than just what we need. */
+    size_t readsize = vn_read_frames() * framesize;
+    while (total_out < target && !rb_is_full(rb) && !atomic_load(&extractor.stop)) {
+        /* Frames held over from the last refill are extracted first. */
+        if (stream.off == stream.frames) {
+            frames = sound_read(vnbuf, readsize);
+            if (sound_xruns() != xruns) {
+                xruns = sound_xruns();
+                trace_event(TRACE_XRUN, (uint32_t)xruns, 0, 0, 0);
+                stream.gap = true;
+                continue;
+            }
+            if (sound_failovers() != failovers) {
+                failovers = sound_failovers();
+                stream.gap = true;
+                continue;
+            }
+            if (gflags_debug) log_line("frames = %zu\n", frames);
+            if (!frames)
+                continue;
+            /* What was buffered across a pause says nothing of the wakeup. */
+            if (stream.gap) {
+                vn_discontinuity();
+                stream.gap = false;
+                ++stream.gaps;
+            } else
+                rt_note_capture(frames + sound_backlog(), sound_period_frames(),
+                                sound_sample_rate());
+            stream.frames = frames;
+            stream.off = 0;
+            for (size_t i = 0; i < pool.ntasks; ++i)
+                pool.task[i].off = 0;
+            stream.read += frames;
+            record_push(vnbuf, frames);
+            if (tzcheck.hist)
+                tz_check(frames);
+
+            if (agc_enabled()) {
+                samples += 2 * frames;
+                clipped += count_clipped(frames);
+            }
         }
-        /* may be inaccurate by one 16-bit value, not worth the speed hit
-           for precise accounting */
-        total_in += i * framesize;
-        total_out = vnstate[0].total_out + vnstate[1].total_out;
+        size_t off = stream.off;
+        unsigned int stored;
+        if (tz)
+            stored = extract_toeplitz();
+        else if (pool.ntasks > 1)
+            stored = extract_parallel();
+        else
+            stored = extract_serial();
+        total_out += stored;
+        total_in += (stream.off - off) * framesize;
+        stream.extracted += stream.off - off;
+        stream.out += stored;
+        if (stored && extractor.progress_fd >= 0)
+            eventfd_write(extractor.progress_fd, 1);
+        if (cpu_budget > 0.0 && throttle_pace(&wall0, &cpu0, &capped))
+            stream.gap = true;
     }
-    sound_stop();
+    if (!continuous) {
+        sound_stop();
+        stream.gap = true;
+    }
+    if (cpu_budget > 0.0) {
+        struct timespec wall, cpu;
+        clock_gettime(CLOCK_MONOTONIC, &wall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        throttle.wall += ts_sub(&wall, &wall0);
+        throttle.cpu += ts_sub(&cpu, &cpu0);
+        ++throttle.refills;
+        throttle.capped += capped;
+    }
+    agc_update(samples, clipped, total_in, total_out);
+    trace_event(TRACE_REFILLED, (uint32_t)total_in, (uint32_t)total_out,
+                rb_num_bytes(rb), (uint32_t)sound_xruns());
 
-    if (gflags_debug) log_line("get_random_data(): in->out bytes = %zu->%zu, eff = %f\n",
-              total_in, total_out, (float)total_out / (float)total_in);
+    if (gflags_debug) log_line("get_random_data(): in->out bytes = %zu->%zu, eff = %f, xruns = %lu\n",
+              total_in, total_out, (float)total_out / (float)total_in, sound_xruns());
 }
@@ -2,7 +2,10 @@
 // SPDX-License-Identifier: MIT
 #ifndef GETRANDOM_H_
 #define GETRANDOM_H_
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "extract.h"
 
 /*
  * Frames are 32-bits in length with 16-bits per channel, and each channel
@@ -12,19 +15,22 @@ struct frame_t {
     int16_t channel[2];
 };
 
-typedef struct {
-    unsigned int total_out;
-    int bits_out[16];
-    char prev_bits[16];
-    unsigned char byte_out[16];
-#ifdef USE_AMLS
-    int amls_bits_out[2][16];
-    char amls_bits[2][16];
-    unsigned char amls_byte_out[2][16];
-#endif
-} vn_renorm_state_t;
-
-void vn_buf_lock(void);
+size_t vn_arena_size(unsigned workers);
+void vn_buf_init(void);
+void vn_workers_start(unsigned n);
+void vn_set_continuous(bool on);
+void vn_set_read_size(unsigned frames);
+size_t vn_read_frames(void);
+void vn_set_transform(enum sndegd_xform xform);
+void vn_set_toeplitz(unsigned ratio);
+void vn_set_cpu_budget(double fraction);
+void vn_extractor_init(void);
+void vn_extractor_start(void);
+void vn_extractor_serve(void);
+void vn_extractor_stop(void);
+void vn_extractor_request(void);
+bool vn_extractor_wait(void);
+void vn_extractor_print_stats(void);
 void print_random_stats(void);
 void get_random_data(unsigned target);
 
@@ -0,0 +1,376 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * PipeWire capture backend.  Built instead of alsa.c with
+ * 'make SOUND_BACKEND=pipewire'.
+ *
+ * The stream runs on a pw_thread_loop.  Its process callback does nothing
+ * but note that a buffer is ready and wake the reader; sound_read() then
+ * dequeues buffers itself with the loop locked and copies straight out of
+ * the mapped PipeWire buffer into the caller's buffer, so samples are never
+ * staged anywhere in between.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "sound.h"
+
+extern bool gflags_debug;
+
+static char *cdevice;
+static const char *cdev_id = DEFAULT_HW_ITEM;
+static unsigned int sample_rate = DEFAULT_SAMPLE_RATE;
+static unsigned int skip_bytes = DEFAULT_SKIP_BYTES;
+static size_t period_frames = DEFAULT_PERIOD_FRAMES;
+static size_t buffer_frames = DEFAULT_BUFFER_FRAMES;
+static size_t pcm_bytes_per_frame;
+static unsigned long xruns;
+
+static struct pw_thread_loop *loop;
+static struct pw_stream *stream;
+static bool stream_failed;
+/* Buffer currently being copied out by sound_read(), and how far into it. */
+static struct pw_buffer *cur;
+static size_t cur_off;
+/* Buffers that the stream has made ready but sound_read() has not taken.
+ * When more than a capture buffer's worth of periods pile up the reader has
+ * fallen behind, which is the PipeWire equivalent of an overrun. */
+static size_t pending, max_pending;
+static bool overrun;
+/* Frames left queued when the last sound_read() returned. */
+static size_t backlog;
+
+static void on_process(void *data)
+{
+    (void)data;
+    if (++pending > max_pending && !overrun) {
+        overrun = true;
+        ++xruns;
+    }
+    pw_thread_loop_signal(loop, false);
+}
+
+static void on_param_changed(void *data, uint32_t id, const struct spa_pod *param)
+{
+    struct spa_audio_info_raw info;
+
+    (void)data;
+    if (!param || id != SPA_PARAM_Format)
+        return;
+    if (spa_format_audio_raw_parse(param, &info) < 0)
+        return;
+    if (info.format != SPA_AUDIO_FORMAT_S16 || info.channels != 2) {
+        log_line("PipeWire negotiated an unusable format for %s\n", cdev_id);
+        stream_failed = true;
+    }
+    if (info.rate != sample_rate) {
+        log_line("PipeWire negotiated %uHz instead of %uHz\n", info.rate, sample_rate);
+        sample_rate = info.rate;
+    }
+    pcm_bytes_per_frame = 2 * sizeof(int16_t);
+    pw_thread_loop_signal(loop, false);
+}
+
+static void on_state_changed(void *data, enum pw_stream_state old,
+                             enum pw_stream_state state, const char *error)
+{
+    (void)data;
+    (void)old;
+    if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED) {
+        log_line("PipeWire stream failed: %s\n", error ? error : "disconnected");
+        stream_failed = true;
+    }
+    if (gflags_debug) log_line("PipeWire stream state: %s\n",
+                               pw_stream_state_as_string(state));
+    pw_thread_loop_signal(loop, false);
+}
+
+static const struct pw_stream_events stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .state_changed = on_state_changed,
+    .param_changed = on_param_changed,
+    .process = on_process,
+};
+
+/* Hands every buffer we hold back to the stream; loop must be locked. */
+static void drop_buffers(void)
+{
+    struct pw_buffer *b;
+
+    if (cur) {
+        pw_stream_queue_buffer(stream, cur);
+        cur = NULL;
+    }
+    while ((b = pw_stream_dequeue_buffer(stream)))
+        pw_stream_queue_buffer(stream, b);
+    pending = 0;
+}
+
+void sound_open(void)
+{
+    char buf[PAGE_SIZE];
+    char latency[32];
+    uint8_t podbuf[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(podbuf, sizeof podbuf);
+    const struct spa_pod *params[1];
+
+    pw_init(NULL, NULL);
+
+    loop = pw_thread_loop_new("snd-egd", NULL);
+    if (!loop)
+        suicide("Could not create PipeWire thread loop\n");
+
+    snprintf(latency, sizeof latency, "%zu/%u", period_frames, sample_rate);
+    struct pw_properties *props =
+        pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+                          PW_KEY_MEDIA_CATEGORY, "Capture",
+                          PW_KEY_MEDIA_ROLE, "Production",
+                          PW_KEY_NODE_LATENCY, latency,
+                          PW_KEY_STREAM_DONT_REMIX, "true",
+                          "resample.disable", "true",
+                          NULL);
+    if (cdevice)
+#ifdef PW_KEY_TARGET_OBJECT
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, cdevice);
+#else
+        pw_properties_set(props, PW_KEY_NODE_TARGET, cdevice);
+#endif
+
+    stream = pw_stream_new_simple(pw_thread_loop_get_loop(loop), "snd-egd",
+                                  props, &stream_events, NULL);
+    if (!stream)
+        suicide("Could not create PipeWire stream\n");
+
+    /* S16 is native endian, so no byte swapping is ever needed. */
+    params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+        &SPA_AUDIO_INFO_RAW_INIT(.format = SPA_AUDIO_FORMAT_S16,
+                                 .channels = 2,
+                                 .rate = sample_rate));
+
+    max_pending = MAX(buffer_frames / period_frames, 2);
+
+    pw_thread_loop_lock(loop);
+    if (pw_thread_loop_start(loop) < 0)
+        suicide("Could not start PipeWire thread loop\n");
+    int err = pw_stream_connect(stream, PW_DIRECTION_INPUT, PW_ID_ANY,
+                                PW_STREAM_FLAG_AUTOCONNECT |
+                                PW_STREAM_FLAG_MAP_BUFFERS,
+                                params, 1);
+    if (err < 0)
+        suicide("Error connecting PipeWire stream to %s: %s\n",
+                cdevice ? cdevice : "default source", spa_strerror(err));
+    while (!pcm_bytes_per_frame && !stream_failed)
+        pw_thread_loop_wait(loop);
+    pw_thread_loop_unlock(loop);
+    if (stream_failed)
+        suicide("Could not set up PipeWire capture from %s\n",
+                cdevice ? cdevice : "default source");
+    if (gflags_debug) log_line("bytes-per-frame: %zu\n", pcm_bytes_per_frame);
+
+    /* Discard the initial data; it may be a click or something else odd. */
+    size_t got_bytes = 0;
+    while (got_bytes < skip_bytes)
+        got_bytes += sound_read(buf, sizeof buf) * pcm_bytes_per_frame;
+    log_line("discarded first %zu bytes of pcm input\n", got_bytes);
+
+    sound_stop();
+}
+
+size_t sound_bytes_per_frame(void)
+{
+    return pcm_bytes_per_frame;
+}
+
+size_t sound_period_frames(void)
+{
+    return period_frames;
+}
+
+unsigned sound_sample_rate(void)
+{
+    return sample_rate;
+}
+
+/*
+ * Returns the number of frames read.  Zero is returned after an overrun;
+ * the caller can detect that case via sound_xruns() and should not treat
+ * the frames on either side of the gap as contiguous.
+ */
+unsigned sound_read(void *buf_, size_t size)
+{
+    unsigned char *buf = buf_;
+    size_t want = size / pcm_bytes_per_frame * pcm_bytes_per_frame;
+    size_t got = 0;
+
+    pw_thread_loop_lock(loop);
+    while (got < want) {
+        if (stream_failed)
+            suicide("sound_read(): PipeWire stream failed\n");
+        if (overrun) {
+            if (gflags_debug) log_line("capture xrun; dropping queued buffers\n");
+            drop_buffers();
+            overrun = false;
+            got = 0;
+            break;
+        }
+        if (!cur) {
+            cur = pw_stream_dequeue_buffer(stream);
+            if (!cur) {
+                pw_thread_loop_wait(loop);
+                continue;
+            }
+            if (pending)
+                --pending;
+            cur_off = 0;
+        }
+        struct spa_data *d = &cur->buffer->datas[0];
+        uint32_t off = SPA_MIN(d->chunk->offset, d->maxsize);
+        uint32_t len = SPA_MIN(d->chunk->size, d->maxsize - off);
+        if (d->data && cur_off < len) {
+            size_t n = MIN(len - cur_off, want - got);
+            memcpy(buf + got, (unsigned char *)d->data + off + cur_off, n);
+            cur_off += n;
+            got += n;
+        }
+        if (!d->data || cur_off >= len) {
+            pw_stream_queue_buffer(stream, cur);
+            cur = NULL;
+        }
+    }
+    /* Queued buffers are counted as whole periods. */
+    backlog = pending * period_frames;
+    if (cur) {
+        struct spa_data *d = &cur->buffer->datas[0];
+        uint32_t off = SPA_MIN(d->chunk->offset, d->maxsize);
+        uint32_t len = SPA_MIN(d->chunk->size, d->maxsize - off);
+        if (cur_off < len)
+            backlog += (len - cur_off) / pcm_bytes_per_frame;
+    }
+    pw_thread_loop_unlock(loop);
+    return (unsigned)(got / pcm_bytes_per_frame);
+}
+
+size_t sound_backlog(void)
+{
+    return backlog;
+}
+
+unsigned long sound_xruns(void)
+{
+    return xruns;
+}
+
+unsigned long sound_failovers(void)
+{
+    return 0;
+}
+
+void sound_print_stats(void)
+{
+}
+
+void sound_start(void)
+{
+    pw_thread_loop_lock(loop);
+    pw_stream_set_active(stream, true);
+    pw_thread_loop_unlock(loop);
+}
+
+void sound_stop(void)
+{
+    pw_thread_loop_lock(loop);
+    pw_stream_set_active(stream, false);
+    drop_buffers();
+    pw_thread_loop_unlock(loop);
+}
+
+void sound_close(void)
+{
+    if (!loop)
+        return;
+    pw_thread_loop_lock(loop);
+    if (cur) {
+        pw_stream_queue_buffer(stream, cur);
+        cur = NULL;
+    }
+    pw_thread_loop_unlock(loop);
+    pw_thread_loop_stop(loop);
+    pw_stream_destroy(stream);
+    pw_thread_loop_destroy(loop);
+    stream = NULL;
+    loop = NULL;
+    pw_deinit();
+}
+
+/* Gain is left to the PipeWire session manager. */
+const struct agc_mixer *sound_mixer(void)
+{
+    return NULL;
+}
+
+int sound_is_le(void)
+{
+#ifdef HOST_ENDIAN_BE
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+int sound_is_be(void)
+{
+    return !sound_is_le();
+}
+
+/* The target node name or serial; the default source is used otherwise. */
+void sound_set_device(char *str)
+{
+    cdevice = strdup(str);
+}
+
+/* PipeWire moves a stream to another node itself when its target goes away. */
+void sound_set_standby(char *str)
+{
+    log_line("pipewire: standby device %s ignored\n", str);
+}
+
+void sound_set_port(char *str)
+{
+    cdev_id = strdup(str);
+}
+
+void sound_set_sample_rate(int rate)
+{
+    if (rate > 0)
+        sample_rate = (unsigned)rate;
+    else
+        sample_rate = DEFAULT_SAMPLE_RATE;
+}
+
+void sound_set_skip_bytes(int sb)
+{
+    if (sb > 0)
+        skip_bytes = (unsigned)sb;
+    else
+        skip_bytes = DEFAULT_SKIP_BYTES;
+}
+
+void sound_set_period_size(int frames)
+{
+    if (frames > 0 && frames <= MAX_PERIOD_FRAMES)
+        period_frames = (size_t)frames;
+    else
+        period_frames = DEFAULT_PERIOD_FRAMES;
+}
+
+void sound_set_buffer_size(int frames)
+{
+    if (frames > 0)
+        buffer_frames = (size_t)frames;
+    else
+        buffer_frames = DEFAULT_BUFFER_FRAMES;
+}
@@ -1,122 +1,116 @@
 // Copyright 2010-2014 Nicholas J. Kain <njkain at gmail dot com>
 // SPDX-License-Identifier: MIT
 /*
- * Simple ring buffer specialized for gathering entropy.  It's not quite
- * general since it assumes that the only necessary distinction between
- * data within the buffer is filled or unfilled, with no regards to
- * actual ordering.
+ * Simple ring buffer specialized for gathering entropy.  New data is xored
+ * into the slots that it occupies rather than replacing their old contents.
+ * See rb.h for the rules that allow one producer and one consumer to use it
+ * concurrently.
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include "nk/log.h"
 #include "rb.h"
 
+/* Producer side: returns the position to store at and the room available. */
+static inline unsigned int rb_producer_room(ring_buffer_t *rb,
+                                            unsigned int *head)
+{
+    unsigned int tail = atomic_load_explicit(&rb->idx->tail, memory_order_acquire);
+    *head = atomic_load_explicit(&rb->idx->head, memory_order_relaxed);
+    return RB_SIZE - MIN(*head - tail, RB_SIZE);
+}
+
 /* returns 1 if store successful, otherwise 0 (error or not enough room) */
 unsigned int rb_store_byte(ring_buffer_t *rb, unsigned char b)
 {
-    if (!rb)
+    unsigned int head;
+
+    if (!rb || !rb_producer_room(rb, &head))
         return 0;
 
-    /* Filling in space before the current index. */
-    if (rb->fill_idx < rb->index) {
-        rb->buf[rb->fill_idx++] = b;
-        rb->bytes++;
-        return 1;
-    } else if (rb->fill_idx > rb->index) {
-        if (rb->fill_idx < rb->size) {
-            /* Filling in space after the current index. */
-            rb->buf[rb->fill_idx++] = b;
-            rb->bytes++;
-            return 1;
-        } else {
-            if (rb->index > 0) {
-                rb->fill_idx = 0;
-                rb->buf[rb->fill_idx++] = b;
-                rb->bytes++;
-                return 1;
-            }
-        }
-    }
-    return 0;
+    rb->buf[head & RB_MASK] = b;
+    atomic_store_explicit(&rb->idx->head, head + 1, memory_order_release);
+    return 1;
 }
 
 /* returns 1 if store successful, otherwise 0 (error or not enough room) */
 unsigned int rb_store_byte_xor(ring_buffer_t *rb, unsigned char b)
 {
-    if (!rb)
+    unsigned int head;
+
+    if (!rb || !rb_producer_room(rb, &head))
         return 0;
 
-    /* Filling in space before the current index. */
-    if (rb->fill_idx < rb->index) {
-        rb->buf[rb->fill_idx++] ^= b;
-        rb->bytes++;
-        return 1;
-    } else if (rb->fill_idx > rb->index) {
-        if (rb->fill_idx < rb->size) {
-            /* Filling in space after the current index. */
-            rb->buf[rb->fill_idx++] ^= b;
-            rb->bytes++;
-            return 1;
-        } else {
-            if (rb->index > 0) {
-                rb->fill_idx = 0;
-                rb->buf[rb->fill_idx++] ^= b;
-                rb->bytes++;
-                return 1;
-            }
-        }
+    rb->buf[head & RB_MASK] ^= b;
+    atomic_store_explicit(&rb->idx->head, head + 1, memory_order_release);
+    return 1;
+}
+
+/* dst ^= src, a machine word at a time where possible */
+static void xor_bytes(unsigned char *dst, const unsigned char *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof a);
+        memcpy(&b, src + i, sizeof b);
+        a ^= b;
+        memcpy(dst + i, &a, sizeof a);
     }
-    return 0;
+    for (; i < n; ++i)
+        dst[i] ^= src[i];
 }
+
+/* returns number of bytes stored, which is less than len if there is not
+ * enough room */
+unsigned int rb_store_block_xor(ring_buffer_t *rb, const unsigned char *b,
+                                unsigned int len)
+{
+    unsigned int head;
+
+    if (!rb)
+        return 0;
+
+    len = MIN(len, rb_producer_room(rb, &head));
+    if (!len)
+        return 0;
+
+    /* At most two spans: up to the end of buf, then from its start. */
+    unsigned int pos = head & RB_MASK;
+    unsigned int span = MIN(len, RB_SIZE - pos);
+    xor_bytes(rb->buf + pos, b, span);
+    if (span < len)
+        xor_bytes(rb->buf, b + span, len - span);
+
+    atomic_store_explicit(&rb->idx->head, head + len, memory_order_release);
+    return len;
+}
+
 /* returns 0 on success, a negative number if not enough bytes or error */
 int rb_move(ring_buffer_t *rb, void *buf_, unsigned int bytes)
 {
     char *buf = (char *)buf_;
-    unsigned int cbytes;
 
     if (!bytes)
         return 0;
 
     if (!rb)
         return -2;
-    if (rb->bytes < bytes)
+
+    unsigned int head = atomic_load_explicit(&rb->idx->head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&rb->idx->tail, memory_order_relaxed);
+    /* The producer may be another, less trusted, process. */
+    if (MIN(head - tail, RB_SIZE) < bytes)
         return -1;
 
-    if (rb->fill_idx < rb->index) {
-        /* We're filling the buffer behind the current index. */
-        if (rb->index < rb->size) {
-            cbytes = MIN(bytes, rb->size - rb->index);
-            memmove(buf, rb->buf + rb->index, cbytes);
-            bytes -= cbytes;
-            rb->index += cbytes;
-            rb->bytes -= cbytes;
-            if (bytes > 0) {
-                rb->index = 0;
-                return rb_move(rb, buf + cbytes, bytes);
-            }
-            return 0;
-        } else {
-            rb->index = 0;
-            return rb_move(rb, buf, bytes);
-        }
-
-    } else if (rb->fill_idx > rb->index) {
-        /* We're filling the buffer after the current index. */
-        cbytes = MIN(bytes, rb->fill_idx - rb->index);
-        memmove(buf, rb->buf + rb->index, cbytes);
-        bytes -= cbytes;
-        rb->index += cbytes;
-        rb->bytes -= cbytes;
-        if (bytes > 0)
-            suicide("Ring buffer hit a state that should never happen.\n");
-        return 0;
-    } else {
-        /* rb->index == rb->fill_idx */
-        if (rb->bytes != rb->size)
-            suicide("Ring buffer hit a state that should never happen 2.\n");
-        rb->index = 0;
-        rb->fill_idx = rb->size;
-        return rb_move(rb, buf, bytes);
-    }
+    unsigned int pos = tail & RB_MASK;
+    unsigned int span = MIN(bytes, RB_SIZE - pos);
+    memcpy(buf, rb->buf + pos, span);
+    if (span < bytes)
+        memcpy(buf + span, rb->buf, bytes - span);
+
+    atomic_store_explicit(&rb->idx->tail, tail + bytes, memory_order_release);
+    return 0;
 }
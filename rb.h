@@ -3,34 +3,53 @@
 #ifndef NK_RING_BUFFER_H_
 #define NK_RING_BUFFER_H_ 1
 /*
- * Simple ring buffer specialized for gathering entropy.  It's not quite
- * general since it assumes that the only necessary distinction between
- * data within the buffer is filled or unfilled, with no regards to
- * actual ordering.
+ * Simple ring buffer specialized for gathering entropy.  New data is xored
+ * into the slots that it occupies rather than replacing their old contents.
+ *
+ * It is safe for exactly one producer (the rb_store_* functions) and one
+ * consumer (rb_move) to use the ring buffer concurrently without a lock.
+ * 'head' counts every byte ever stored and is only written by the producer;
+ * 'tail' counts every byte ever removed and is only written by the consumer.
+ * Both wrap freely and are masked down to a position in buf, so RB_SIZE must
+ * be a power of two.  Each side publishes its position with a release store
+ * after it is done touching buf, and reads the other side's position with an
+ * acquire load before touching buf.  The indices are lock-free atomics, so
+ * this holds just as well when the ring buffer is in memory shared between
+ * two processes.
+ *
+ * Only the indices and the bytes in buf are shared then.  Each process keeps
+ * its own ring_buffer_t pointing at them, and every bound comes from RB_SIZE,
+ * so the other process can at worst hand over garbage; it can never steer a
+ * copy outside of buf.
  */
 
-#include <sys/mman.h>
+#include <stdatomic.h>
 
 #include "defines.h"
-#include "string.h"
+
+_Static_assert((RB_SIZE & (RB_SIZE - 1)) == 0, "RB_SIZE must be a power of two");
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "ring buffer indices must be lock-free");
+
+#define RB_MASK (RB_SIZE - 1)
+
+struct rb_index {
+    _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+};
 
 typedef struct {
-    unsigned char buf[RB_SIZE];
-    unsigned int size; /* max size of the buffer in bytes */
-    unsigned int bytes; /* current size of the buffer in bytes */
-    unsigned int index;
-    unsigned int fill_idx;
+    unsigned char *buf; /* RB_SIZE bytes of locked memory */
+    struct rb_index *idx;
 } ring_buffer_t;
 
-/* creates a new, empty ring buffer */
-static inline void rb_init(ring_buffer_t *rb)
+/* creates a new, empty ring buffer over buf, which holds RB_SIZE bytes */
+static inline void rb_init(ring_buffer_t *rb, struct rb_index *idx,
+                           unsigned char *buf)
 {
-    rb->size = RB_SIZE;
-    rb->index = RB_SIZE;
-    rb->fill_idx = 0;
-    rb->bytes = 0;
-    mlock(rb->buf, RB_SIZE);
-    memset(rb->buf, '\0', RB_SIZE);
+    rb->buf = buf;
+    rb->idx = idx;
+    atomic_init(&idx->head, 0);
+    atomic_init(&idx->tail, 0);
 }
 
 /* returns number of bytes stored in the ring buffer */
@@ -39,13 +58,24 @@ static inline unsigned int rb_num_bytes(ring_buffer_t *rb)
     if (!rb)
         return 0;
 
-    return rb->bytes;
+    unsigned int tail = atomic_load_explicit(&rb->idx->tail, memory_order_acquire);
+    unsigned int head = atomic_load_explicit(&rb->idx->head, memory_order_acquire);
+    return MIN(head - tail, RB_SIZE);
+}
+
+/* returns number of bytes that can still be stored in the ring buffer */
+static inline unsigned int rb_num_free(ring_buffer_t *rb)
+{
+    if (!rb)
+        return 0;
+
+    return RB_SIZE - rb_num_bytes(rb);
 }
 
 /* returns 1 if the ring buffer is full or 0 if it is not full */
 static inline int rb_is_full(ring_buffer_t *rb)
 {
-    if (!rb || rb->bytes >= rb->size)
+    if (!rb || rb_num_bytes(rb) >= RB_SIZE)
         return 1;
     else
         return 0;
@@ -55,6 +85,10 @@ static inline int rb_is_full(ring_buffer_t *rb)
 unsigned int rb_store_byte(ring_buffer_t *rb, unsigned char b);
 /* returns 1 if store successful, otherwise 0 (error or not enough room) */
 unsigned int rb_store_byte_xor(ring_buffer_t *rb, unsigned char b);
+/* returns number of bytes stored, which is less than len if there is not
+ * enough room */
+unsigned int rb_store_block_xor(ring_buffer_t *rb, const unsigned char *b,
+                                unsigned int len);
 /* returns 0 on success, a negative number if not enough bytes or error */
 int rb_move(ring_buffer_t *rb, void *buf, unsigned int bytes);
 
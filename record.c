@@ -0,0 +1,261 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * --record: tees the raw captured periods into a WAV file.
+ *
+ * The capture path must never wait on the disk, so each read is copied
+ * into one of a fixed set of slots that form a lock-free single-producer,
+ * single-consumer queue, and a writer thread empties the queue.  A slot
+ * holds the largest read, so a read is always queued or dropped whole.  The
+ * positions work like those in rb.h: 'head' counts slots ever filled and is
+ * only written by the capture side, 'tail' counts slots ever written out and
+ * is only written by the writer.  If every slot is full when a read
+ * arrives, that read is dropped and counted rather than waited for.
+ *
+ * The slots are page aligned and contiguous, and the writer hands every
+ * ready slot to a single writev(), so the file is written in large blocks.
+ *
+ * The recording holds the exact samples that the output was extracted from.
+ * It must be treated as being as secret as the output itself, and is meant
+ * for diagnosis only.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "sound.h"
+#include "record.h"
+
+extern bool gflags_debug;
+
+#define RECORD_SLOTS 64 /* at most; must be a power of two */
+#define RECORD_MIN_SLOTS 4
+#define WAV_HEADER_SIZE 44
+
+_Static_assert((RECORD_SLOTS & (RECORD_SLOTS - 1)) == 0,
+               "RECORD_SLOTS must be a power of two");
+
+static const char *path;
+static int fd = -1;
+static int wake_fd = -1;
+static pthread_t tid;
+static bool running;
+static atomic_bool stop;
+
+static unsigned char *slots;
+static size_t slot_size;
+static unsigned nslots;         /* a power of two */
+static size_t slot_len[RECORD_SLOTS];
+static _Atomic unsigned head, tail;
+
+static unsigned long long data_bytes;
+static unsigned long long reads, dropped;
+
+void record_set_path(const char *p)
+{
+    path = strdup(p);
+}
+
+bool record_enabled(void)
+{
+    return path != NULL;
+}
+
+static inline void put_le16(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+/* Sizes are left at zero until record_stop() fills them in. */
+static void write_header(uint32_t data_size)
+{
+    unsigned char h[WAV_HEADER_SIZE];
+    unsigned rate = sound_sample_rate();
+    unsigned frame = (unsigned)sound_bytes_per_frame();
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, data_size ? data_size + WAV_HEADER_SIZE - 8 : 0);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1);            /* PCM */
+    put_le16(h + 22, 2);            /* channels */
+    put_le32(h + 24, rate);
+    put_le32(h + 28, rate * frame);
+    put_le16(h + 32, frame);
+    put_le16(h + 34, 16);           /* bits per sample */
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, data_size);
+    if (pwrite(fd, h, sizeof h, 0) != (ssize_t)sizeof h)
+        log_line("record: failed to write WAV header: %s\n", strerror(errno));
+}
+
+/* Opened while we still have the privileges and the path is still visible. */
+void record_open(void)
+{
+    if (!path)
+        return;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        suicide("Couldn't open recording '%s': %s\n", path, strerror(errno));
+}
+
+static void swap16(unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        unsigned char t = p[i];
+        p[i] = p[i + 1];
+        p[i + 1] = t;
+    }
+}
+
+static void write_slots(unsigned from, unsigned to)
+{
+    struct iovec iov[RECORD_SLOTS];
+    int n = 0;
+
+    for (unsigned i = from; i != to; ++i) {
+        unsigned char *p = slots + (i & (nslots - 1)) * slot_size;
+        size_t len = slot_len[i & (nslots - 1)];
+        if (sound_is_be())
+            swap16(p, len);
+        iov[n].iov_base = p;
+        iov[n].iov_len = len;
+        ++n;
+    }
+    struct iovec *v = iov;
+    while (n) {
+        ssize_t r = writev(fd, v, n);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            log_line("record: write failed, recording stopped: %s\n", strerror(errno));
+            atomic_store(&stop, true);
+            return;
+        }
+        data_bytes += (size_t)r;
+        while (n && (size_t)r >= v->iov_len) {
+            r -= (ssize_t)v->iov_len;
+            ++v;
+            --n;
+        }
+        if (n) {
+            v->iov_base = (unsigned char *)v->iov_base + r;
+            v->iov_len -= (size_t)r;
+        }
+    }
+}
+
+static void *record_writer(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        unsigned t = atomic_load_explicit(&tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&head, memory_order_acquire);
+        if (h != t) {
+            write_slots(t, h);
+            atomic_store_explicit(&tail, h, memory_order_release);
+            continue;
+        }
+        if (atomic_load(&stop))
+            break;
+        eventfd_t v;
+        if (eventfd_read(wake_fd, &v) && errno != EINTR)
+            suicide("record: eventfd_read failed: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+/*
+ * 'frames' is the most that record_push() is ever passed.  The queue holds
+ * RECORD_SLOTS periods, or RECORD_MIN_SLOTS reads if those are larger.
+ */
+void record_start(size_t frames)
+{
+    if (fd == -1)
+        return;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t period = MIN(MAX_PERIOD_FRAMES, sound_period_frames());
+    frames = MAX(frames, period);
+    nslots = RECORD_SLOTS;
+    while (nslots > RECORD_MIN_SLOTS && nslots * frames > RECORD_SLOTS * period)
+        nslots /= 2;
+    slot_size = frames * sound_bytes_per_frame();
+    slot_size = (slot_size + (size_t)page - 1) & ~((size_t)page - 1);
+    if (posix_memalign((void **)&slots, (size_t)page, nslots * slot_size))
+        suicide("record: could not allocate %zu bytes\n", nslots * slot_size);
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0)
+        suicide("record: eventfd failed: %s\n", strerror(errno));
+    write_header(0);
+    if (lseek(fd, WAV_HEADER_SIZE, SEEK_SET) < 0)
+        suicide("record: lseek failed: %s\n", strerror(errno));
+
+    /* Signals are always handled by the main thread. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int r = pthread_create(&tid, NULL, record_writer, NULL);
+    if (r)
+        suicide("pthread_create failed: %s\n", strerror(r));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    running = true;
+    log_line("recording captured audio to %s\n", path);
+}
+
+/* Called from the capture path with each read, of at most one slot. */
+void record_push(const void *pcm, size_t frames)
+{
+    if (!running || !frames || atomic_load_explicit(&stop, memory_order_relaxed))
+        return;
+    ++reads;
+    unsigned h = atomic_load_explicit(&head, memory_order_relaxed);
+    unsigned t = atomic_load_explicit(&tail, memory_order_acquire);
+    if (h - t == nslots) {
+        ++dropped;
+        return;
+    }
+    size_t len = MIN(frames * sound_bytes_per_frame(), slot_size);
+    memcpy(slots + (h & (nslots - 1)) * slot_size, pcm, len);
+    slot_len[h & (nslots - 1)] = len;
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    eventfd_write(wake_fd, 1);
+}
+
+/* Writes out whatever is queued and completes the WAV header. */
+void record_stop(void)
+{
+    if (!running)
+        return;
+    atomic_store(&stop, true);
+    eventfd_write(wake_fd, 1);
+    pthread_join(tid, NULL);
+    running = false;
+    write_header((uint32_t)MIN(data_bytes, (unsigned long long)UINT32_MAX - WAV_HEADER_SIZE));
+    close(fd);
+    fd = -1;
+}
+
+void record_print_stats(void)
+{
+    if (!path)
+        return;
+    log_line("record: %llu reads captured, %llu dropped, %llu bytes written\n",
+             reads, dropped, data_bytes);
+}
@@ -0,0 +1,16 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_RECORD_H_
+#define NJK_RECORD_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+void record_set_path(const char *path);
+bool record_enabled(void);
+void record_open(void);
+void record_start(size_t frames);
+void record_push(const void *pcm, size_t frames);
+void record_stop(void);
+void record_print_stats(void);
+
+#endif
@@ -0,0 +1,145 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * Realtime capture support: a fixed-priority scheduling policy, CPU
+ * affinity, and pre-faulted memory so that the capture path is not
+ * preempted or stalled on page faults long enough for the sound card to
+ * overrun.  Threads created after rt_enable() inherit its settings.
+ */
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "rt.h"
+
+extern bool gflags_debug;
+
+#define RT_PREFAULT_STACK (64 * 1024)
+
+static int rt_policy = SCHED_FIFO;
+static int rt_priority;
+static cpu_set_t rt_cpus;
+static bool have_cpus;
+
+/* Lateness of capture wakeups, a direct measure of scheduling latency. */
+static unsigned long lat_count;
+static long lat_max_ns;
+static long long lat_sum_ns;
+
+bool rt_set_priority(int prio)
+{
+    int lo = sched_get_priority_min(rt_policy);
+    int hi = sched_get_priority_max(rt_policy);
+    if (prio < lo || prio > hi) {
+        log_line("realtime priority out of range: %d to %d\n", lo, hi);
+        return false;
+    }
+    rt_priority = prio;
+    return true;
+}
+
+bool rt_set_policy(const char *name)
+{
+    if (!strcmp(name, "fifo"))
+        rt_policy = SCHED_FIFO;
+    else if (!strcmp(name, "rr"))
+        rt_policy = SCHED_RR;
+    else {
+        log_line("unknown realtime policy '%s': use fifo or rr\n", name);
+        return false;
+    }
+    return true;
+}
+
+/* Accepts a list such as "2" or "0,2-3". */
+bool rt_set_cpus(const char *list)
+{
+    const char *p = list;
+
+    CPU_ZERO(&rt_cpus);
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            goto bad;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p)
+                goto bad;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            goto bad;
+        for (long c = lo; c <= hi; ++c)
+            CPU_SET((size_t)c, &rt_cpus);
+        if (*end == ',')
+            ++end;
+        else if (*end)
+            goto bad;
+        p = end;
+    }
+    have_cpus = CPU_COUNT(&rt_cpus) > 0;
+    return have_cpus;
+bad:
+    log_line("invalid cpu list '%s'\n", list);
+    return false;
+}
+
+bool rt_active(void)
+{
+    return rt_priority > 0;
+}
+
+/* Must be called before privileges are dropped. */
+void rt_enable(void)
+{
+    if (have_cpus && sched_setaffinity(0, sizeof rt_cpus, &rt_cpus))
+        suicide("sched_setaffinity failed: %s\n", strerror(errno));
+    if (rt_priority) {
+        struct sched_param sp = { .sched_priority = rt_priority };
+        if (sched_setscheduler(0, rt_policy, &sp))
+            suicide("sched_setscheduler failed: %s\n", strerror(errno));
+        log_line("running at %s priority %d\n",
+                 rt_policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority);
+    }
+}
+
+/* Touches enough stack that the capture path never faults on it; the
+ * pages stay resident because all memory is locked in realtime mode. */
+void rt_prefault(void)
+{
+    volatile unsigned char stack[RT_PREFAULT_STACK];
+    for (size_t i = 0; i < sizeof stack; i += PAGE_SIZE)
+        stack[i] = 0;
+}
+
+/*
+ * Notes one capture read that found avail frames waiting.  The device wakes
+ * the reader once a period is ready, so anything beyond a period had been
+ * captured while the reader was still on its way, and its duration is how
+ * late the read was.
+ */
+void rt_note_capture(size_t avail, size_t period, unsigned rate)
+{
+    if (!rate)
+        return;
+    long ns = avail > period
+            ? (long)((double)(avail - period) * 1e9 / (double)rate) : 0;
+    ++lat_count;
+    lat_sum_ns += ns;
+    if (ns > lat_max_ns)
+        lat_max_ns = ns;
+}
+
+void rt_print_stats(void)
+{
+    if (!gflags_debug)
+        return;
+    if (lat_count)
+        log_line("capture wakeup latency: mean %lld us, max %ld us over %lu reads\n",
+                 lat_sum_ns / (long long)lat_count / 1000, lat_max_ns / 1000,
+                 lat_count);
+}
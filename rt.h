@@ -0,0 +1,17 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_RT_H_
+#define NJK_RT_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+bool rt_set_priority(int prio);
+bool rt_set_policy(const char *name);
+bool rt_set_cpus(const char *list);
+bool rt_active(void);
+void rt_enable(void);
+void rt_prefault(void);
+void rt_note_capture(size_t avail, size_t period, unsigned rate);
+void rt_print_stats(void);
+
+#endif
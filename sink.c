@@ -0,0 +1,274 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/random.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "arena.h"
+#include "sink.h"
+#include "trace.h"
+
+extern bool gflags_debug;
+
+#define SINK_BUFFER_SIZE (256 * 1024)
+
+// Essentially the same as linux/random.h's struct rand_pool_info,
+// but we can't use that directly since this struct is intended
+// to be stack allocated.
+struct pool_buffer_t {
+    int entropy_count;
+    int buf_size;
+    uint32_t buf[POOL_BUFFER_SIZE / 4];
+};
+
+enum sink_type {
+    SINK_KERNEL = 0,
+    SINK_FILE,
+    SINK_NULL,
+};
+
+static enum sink_type type;
+static const char *out_path;
+static int fd = -1;
+static bool closed;
+static unsigned long long total_bytes;
+
+// Entropy on its way to the kernel; lives in the secure arena.
+static struct pool_buffer_t *pool_buf;
+
+/*
+ * Output buffers for the file sink.  Regular files get a single buffer that
+ * is written out with write() whenever it fills.  Pipes get two buffers that
+ * are each exactly as large as the pipe and are handed over alternately with
+ * vmsplice(), which maps our pages into the pipe instead of copying them.
+ * A buffer may only be refilled once the reader has consumed it; since the
+ * pipe cannot hold more than one buffer's worth, that is guaranteed as soon
+ * as the other buffer has been spliced in full.
+ */
+static unsigned char *buf[2];
+static size_t buf_size, buf_len;
+static int buf_cur;
+static bool is_pipe;
+
+void sink_set_output(const char *path)
+{
+    type = SINK_FILE;
+    out_path = strdup(path);
+}
+
+void sink_set_null(void)
+{
+    type = SINK_NULL;
+}
+
+bool sink_is_kernel(void)
+{
+    return type == SINK_KERNEL;
+}
+
+void sink_open(void)
+{
+    struct stat st;
+
+    switch (type) {
+    case SINK_KERNEL:
+        fd = open(RANDOM_DEVICE, O_RDWR);
+        if (fd == -1)
+            suicide("Couldn't open random device: %s\n", strerror(errno));
+        break;
+    case SINK_FILE:
+        if (!strcmp(out_path, "-"))
+            fd = STDOUT_FILENO;
+        else {
+            fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd == -1)
+                suicide("Couldn't open output '%s': %s\n", out_path, strerror(errno));
+        }
+        if (fstat(fd, &st))
+            suicide("Couldn't stat output: %s\n", strerror(errno));
+        is_pipe = S_ISFIFO(st.st_mode);
+        buf_size = SINK_BUFFER_SIZE;
+        if (is_pipe) {
+            fcntl(fd, F_SETPIPE_SZ, SINK_BUFFER_SIZE);
+            int ps = fcntl(fd, F_GETPIPE_SZ);
+            if (ps > 0)
+                buf_size = (size_t)ps;
+            else
+                is_pipe = false;
+        }
+        if (gflags_debug) log_line("writing output to %s with %s, %zu byte buffers\n",
+                                   out_path, is_pipe ? "vmsplice" : "write", buf_size);
+        break;
+    case SINK_NULL:
+        break;
+    }
+}
+
+/* For a process that will never write to the sink. */
+void sink_close(void)
+{
+    if (fd >= 0 && fd != STDOUT_FILENO)
+        close(fd);
+    fd = -1;
+}
+
+/* Arena space needed by sink_init(); valid after sink_open(). */
+size_t sink_arena_size(void)
+{
+    switch (type) {
+    case SINK_KERNEL: return ARENA_SIZE(sizeof *pool_buf);
+    case SINK_FILE: return (is_pipe ? 2 : 1) * ARENA_SIZE(buf_size);
+    case SINK_NULL: return ARENA_SIZE(POOL_BUFFER_SIZE);
+    }
+    return 0;
+}
+
+void sink_init(void)
+{
+    switch (type) {
+    case SINK_KERNEL:
+        pool_buf = arena_alloc(sizeof *pool_buf);
+        break;
+    case SINK_FILE:
+        buf[0] = arena_alloc(buf_size);
+        if (is_pipe)
+            buf[1] = arena_alloc(buf_size);
+        break;
+    case SINK_NULL:
+        buf[0] = arena_alloc(POOL_BUFFER_SIZE);
+        buf_size = POOL_BUFFER_SIZE;
+        break;
+    }
+}
+
+static bool output_error(ssize_t r)
+{
+    if (r >= 0 || errno == EINTR || errno == EAGAIN)
+        return false;
+    if (errno == EPIPE) {
+        log_line("output closed\n");
+        closed = true;
+        return true;
+    }
+    suicide("Error writing output: %s\n", strerror(errno));
+}
+
+static void write_buffer(void)
+{
+    struct iovec iov = { .iov_base = buf[buf_cur], .iov_len = buf_len };
+
+    while (iov.iov_len && !closed) {
+        ssize_t r = is_pipe ? vmsplice(fd, &iov, 1, 0)
+                            : write(fd, iov.iov_base, iov.iov_len);
+        if (output_error(r) || r < 0)
+            continue;
+        iov.iov_base = (unsigned char *)iov.iov_base + r;
+        iov.iov_len -= (size_t)r;
+    }
+    buf_len = 0;
+    if (is_pipe)
+        buf_cur ^= 1;
+}
+
+/* Credits the kernel with up to POOL_BUFFER_SIZE bytes from the ring buffer. */
+static unsigned drain_kernel(ring_buffer_t *rb, unsigned bytes)
+{
+    if (!bytes)
+        return 0;
+    bytes = MIN(bytes, POOL_BUFFER_SIZE);
+    pool_buf->entropy_count = (int)MIN(bytes * 8, (unsigned)INT_MAX);
+    pool_buf->buf_size = (int)MIN(bytes, (unsigned)INT_MAX);
+    if (rb_move(rb, pool_buf->buf, bytes) == -1)
+        suicide("rb_move() failed\n");
+
+    uint64_t t0 = trace_now();
+    if (ioctl(fd, RNDADDENTROPY, pool_buf) == -1)
+        suicide("RNDADDENTROPY failed!\n");
+    trace_event(TRACE_CREDIT, bytes, (uint32_t)(trace_now() - t0), rb_num_bytes(rb), 0);
+    return bytes;
+}
+
+/*
+ * Moves up to 'bytes' bytes out of the ring buffer and into the sink.
+ * @return number of bytes delivered
+ */
+unsigned sink_drain(ring_buffer_t *rb, unsigned bytes)
+{
+    unsigned done = 0;
+
+    bytes = MIN(bytes, rb_num_bytes(rb));
+    if (type == SINK_KERNEL) {
+        done = drain_kernel(rb, bytes);
+        total_bytes += done;
+        return done;
+    }
+    while (done < bytes && !closed) {
+        unsigned n = (unsigned)MIN(bytes - done, buf_size - buf_len);
+        if (rb_move(rb, buf[buf_cur] + buf_len, n) == -1)
+            suicide("rb_move() failed\n");
+        buf_len += n;
+        done += n;
+        if (buf_len == buf_size) {
+            if (type == SINK_NULL)
+                buf_len = 0;
+            else
+                write_buffer();
+        }
+    }
+    total_bytes += done;
+    return done;
+}
+
+/* The kernel's entropy count in bits, or -1 if it cannot be read. */
+int sink_entropy_avail(void)
+{
+    int n;
+    if (type != SINK_KERNEL || ioctl(fd, RNDGETENTCNT, &n) == -1)
+        return -1;
+    return n;
+}
+
+/*
+ * Sleeps for up to timeout_ms, or until the kernel wakes writers of the
+ * random device because it wants entropy, if 'demand' is set.
+ * @return 1 if the kernel asked for entropy, 0 on timeout, -1 if interrupted
+ */
+int sink_wait(long timeout_ms, bool demand)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int r = poll(&pfd, demand ? 1 : 0, (int)MIN(timeout_ms, (long)INT_MAX));
+    if (r < 0) {
+        if (errno == EINTR)
+            return -1;
+        suicide("poll on random device failed: %s\n", strerror(errno));
+    }
+    return r > 0 && (pfd.revents & POLLOUT);
+}
+
+bool sink_closed(void)
+{
+    return closed;
+}
+
+void sink_flush(void)
+{
+    if (type == SINK_FILE && buf_len)
+        write_buffer();
+}
+
+void sink_print_stats(void)
+{
+    if (gflags_debug) log_line("%llu bytes sent to %s\n", total_bytes,
+                               type == SINK_KERNEL ? "the kernel"
+                               : type == SINK_FILE ? out_path : "the null sink");
+}
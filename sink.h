@@ -0,0 +1,28 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_SINK_H_
+#define NJK_SINK_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include "rb.h"
+
+/*
+ * Where whitened output goes.  The kernel sink credits the kernel random
+ * device and is the default; the file sink writes raw bytes to a file or
+ * stdout; the null sink discards them, for benchmarking.
+ */
+void sink_set_output(const char *path);
+void sink_set_null(void);
+bool sink_is_kernel(void);
+void sink_open(void);
+void sink_close(void);
+size_t sink_arena_size(void);
+void sink_init(void);
+unsigned sink_drain(ring_buffer_t *rb, unsigned bytes);
+int sink_entropy_avail(void);
+int sink_wait(long timeout_ms, bool demand);
+bool sink_closed(void);
+void sink_flush(void);
+void sink_print_stats(void);
+
+#endif
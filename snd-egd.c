@@ -5,14 +5,14 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
-#include <linux/random.h>
 #include <sys/capability.h>
-#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -23,30 +23,75 @@
 #include "sound.h"
 #include "rb.h"
 #include "getrandom.h"
+#include "agc.h"
+#include "rt.h"
+#include "arena.h"
+#include "sink.h"
+#include "fips.h"
+#include "record.h"
+#include "trace.h"
+#include "demand.h"
+#include "toeplitz.h"
 
 bool gflags_debug = 0;
 
-ring_buffer_t rb;
+ring_buffer_t *rb;
 
-static int refill_timeout = DEFAULT_REFILL_SECS;
-
-// Essentially the same as linux/random.h's struct rand_pool_info,
-// but we can't use that directly since this struct is intended
-// to be stack allocated.
-struct pool_buffer_t {
-    int entropy_count;
-    int buf_size;
-    uint32_t buf[POOL_BUFFER_SIZE / 4];
+/*
+ * With --user, crediting the kernel is split off from capture.  The feeder
+ * process keeps CAP_SYS_ADMIN and does nothing but move bytes from the ring
+ * buffer into RNDADDENTROPY; a forked capture process with no capabilities
+ * at all opens the sound device and runs the extractor.  The ring buffer is
+ * in locked shared memory and the two sides use the same eventfd handshake
+ * that the in-process extractor thread does, so nothing is copied on the way
+ * and the feeder still sleeps until output is available.
+ */
+enum role {
+    ROLE_SINGLE = 0,
+    ROLE_FEEDER,
+    ROLE_CAPTURE,
 };
+static enum role role;
+static pid_t capture_pid;
+
+static int refill_timeout = DEFAULT_REFILL_SECS;
+static unsigned workers = 1;
+static bool use_agc;
 
 static char *chroot_path;
 
+static void stop_capture_process(void)
+{
+    if (kill(capture_pid, SIGTERM))
+        suicide("couldn't stop the capture process: %s\n", strerror(errno));
+    while (waitpid(capture_pid, NULL, 0) == -1 && errno == EINTR);
+    capture_pid = 0;
+}
+
+static void print_stats(void)
+{
+    if (role != ROLE_FEEDER) {
+        print_random_stats();
+        record_print_stats();
+    }
+    if (role != ROLE_CAPTURE) {
+        vn_extractor_print_stats();
+        sink_print_stats();
+        demand_print_stats();
+    }
+}
+
 static void exit_cleanup(void)
 {
     if (munlockall() == -1)
         suicide("problem unlocking pages\n");
+    if (role == ROLE_FEEDER)
+        stop_capture_process();
+    vn_extractor_stop();
+    record_stop();
+    sink_flush();
     sound_close();
-    print_random_stats();
+    print_stats();
     exit(EXIT_SUCCESS);
 }
 
@@ -55,11 +100,13 @@ enum {
     SIGNAL_EXIT,
     SIGNAL_PRINT_STATS,
     SIGNAL_DEBUG,
+    SIGNAL_CHILD,
 };
 
 static volatile sig_atomic_t l_signal_exit;
 static volatile sig_atomic_t l_signal_print_stats;
 static volatile sig_atomic_t l_signal_debug;
+static volatile sig_atomic_t l_signal_child;
 // Intended to be called in a loop until SIGNAL_NONE is returned.
 static int signals_flagged(void)
 {
@@ -75,17 +122,23 @@ static int signals_flagged(void)
         l_signal_debug = 0;
         return SIGNAL_DEBUG;
     }
+    if (l_signal_child) {
+        l_signal_child = 0;
+        return SIGNAL_CHILD;
+    }
     return SIGNAL_NONE;
 }
 
 static void signal_handler(int signo)
 {
     int serrno = errno;
+    trace_event(TRACE_SIGNAL, (uint32_t)signo, 0, 0, 0);
     switch (signo) {
     case SIGINT:
     case SIGTERM: l_signal_exit = 1; break;
     case SIGUSR1: l_signal_print_stats = 1; break;
     case SIGUSR2: l_signal_debug = 1; break;
+    case SIGCHLD: l_signal_child = 1; break;
     default: break;
     }
     errno = serrno;
@@ -94,7 +147,7 @@ static void signal_handler(int signo)
 static void setup_signals(void)
 {
     static const int ss[] = {
-        SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGKILL
+        SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGCHLD, SIGKILL
     };
     sigset_t mask;
 
@@ -131,14 +184,24 @@ static void signal_dispatch(void)
         if (s == SIGNAL_PRINT_STATS) {
             bool t = gflags_debug;
             gflags_debug = true;
-            print_random_stats();
+            print_stats();
+            trace_dump();
             gflags_debug = t;
+            if (role == ROLE_FEEDER)
+                kill(capture_pid, SIGUSR1);
             break;
         }
         if (s == SIGNAL_DEBUG) {
             gflags_debug = !gflags_debug;
+            if (role == ROLE_FEEDER)
+                kill(capture_pid, SIGUSR2);
             break;
         }
+        if (s == SIGNAL_CHILD && role == ROLE_FEEDER) {
+            int status;
+            if (waitpid(capture_pid, &status, WNOHANG) == capture_pid)
+                suicide("capture process exited unexpectedly (status %d)\n", status);
+        }
     }
 }
 
@@ -168,8 +231,7 @@ static unsigned random_max_bits(void)
  * arrays.
  * @return number of bits that were loaded to the KRNG
  */
-static unsigned int add_entropy(struct pool_buffer_t *poolbuf, int handle,
-                                unsigned wanted_bits)
+static unsigned int add_entropy(unsigned wanted_bits)
 {
     unsigned int total_cur_bytes;
     unsigned int wanted_bytes;
@@ -178,75 +240,248 @@ static unsigned int add_entropy(struct pool_buffer_t *poolbuf, int handle,
     if (wanted_bits & 7)
         ++wanted_bytes;
 
-    total_cur_bytes = rb_num_bytes(&rb);
+    total_cur_bytes = rb_num_bytes(rb);
 
     if (total_cur_bytes < wanted_bytes)
         wanted_bytes = total_cur_bytes;
 
-    wanted_bytes = MIN(wanted_bytes, POOL_BUFFER_SIZE);
-    poolbuf->entropy_count = (int)MIN(wanted_bytes * 8, (unsigned)INT_MAX);
-    poolbuf->buf_size = (int)MIN(wanted_bytes, (unsigned)INT_MAX);
-    if (rb_move(&rb, poolbuf->buf, wanted_bytes) == -1)
-        suicide("rb_move() failed\n");
-
-    if (ioctl(handle, RNDADDENTROPY, poolbuf) == -1)
-        suicide("RNDADDENTROPY failed!\n");
+    wanted_bytes = sink_drain(rb, wanted_bytes);
 
     if (gflags_debug) log_line("%d bits requested, %d bits in RB, %d bits added, %d bits left in RB\n",
-              wanted_bits, total_cur_bytes * 8, wanted_bytes * 8, rb_num_bytes(&rb) * 8);
+              wanted_bits, total_cur_bytes * 8, wanted_bytes * 8, rb_num_bytes(rb) * 8);
 
     return wanted_bytes * 8;
 }
 
-static void fill_entropy_amount(int random_fd, unsigned max_bits, unsigned wanted_bits)
+static void fill_entropy_amount(unsigned max_bits, unsigned wanted_bits)
 {
-    struct pool_buffer_t poolbuf;
-
     if (wanted_bits > max_bits)
         wanted_bits = max_bits;
 
     /*
-     * Loop until the buffer is full: we do not check the number of
-     * bits currently in the buffer on each iteration, since it
-     * might cause snd-egd to run constantly if there are
-     * a lot of bytes being consumed from the random device.
+     * Credit whatever the ring buffer holds until a pool's worth has been
+     * supplied.  We do not check the kernel's entropy count on each
+     * iteration, since it might cause snd-egd to run constantly if there
+     * are a lot of bytes being consumed from the random device.  When the
+     * ring buffer runs dry, sleep until the extractor has made progress,
+     * then credit whatever it has produced so far.
      */
-    for (unsigned i = 0; i < wanted_bits;)
-        i += add_entropy(&poolbuf, random_fd, wanted_bits - i);
+    for (unsigned i = 0; i < wanted_bits;) {
+        if (rb_num_bytes(rb) < RB_SIZE / 4)
+            vn_extractor_request();
+        unsigned got = add_entropy(wanted_bits - i);
+        i += got;
+        if (!got && !vn_extractor_wait())
+            signal_dispatch();
+    }
+
+    if (rb_num_bytes(rb) < RB_SIZE / 4)
+        vn_extractor_request();
+}
+
+enum {
+    WAKE_NONE = 0,
+    WAKE_TIMER,
+    WAKE_DEMAND,
+    WAKE_PREFILL,
+};
 
-    if (rb.bytes < sizeof rb.buf / 4)
-        get_random_data(rb.size - rb.bytes);
+/*
+ * With --predict: sleeps until the next timed refill, until the kernel asks
+ * for entropy, or until the forecast says to sample or to prefill, and feeds
+ * what it saw to the forecast.
+ */
+static int demand_wait(const struct timespec *next)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (long)(next->tv_sec - now.tv_sec) * 1000
+            + (next->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    ms = MAX(0, MIN(ms, demand_timeout_ms()));
+    int r = sink_wait(ms, demand_use_pollout());
+    if (r < 0)
+        return WAKE_NONE;
+
+    if (demand_sample(sink_entropy_avail(), r))
+        return WAKE_DEMAND;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next->tv_sec
+        || (now.tv_sec == next->tv_sec && now.tv_nsec >= next->tv_nsec))
+        return WAKE_TIMER;
+    return demand_prefill_due() ? WAKE_PREFILL : WAKE_NONE;
+}
+
+static int timer_wait(const struct timespec *next)
+{
+    int r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+    if (r) {
+        if (r == EINTR) return WAKE_NONE;
+        suicide("clock_nanosleep: unexpected error: %s\n", strerror(r));
+    }
+    return WAKE_TIMER;
 }
 
-static void main_loop(int random_fd, unsigned max_bits)
+static void main_loop(unsigned max_bits)
 {
-    struct timespec ts;
+    static const char *why[] = {
+        [WAKE_TIMER] = "timeout", [WAKE_DEMAND] = "kernel asked",
+        [WAKE_PREFILL] = "demand predicted",
+    };
+    struct timespec ts, t0, t1;
     int r = clock_gettime(CLOCK_MONOTONIC, &ts);
     if (r < 0) suicide("clock_gettime: unexpected error: %s\n", strerror(errno));
+    int w = WAKE_TIMER;
     goto start;
     for (;;) {
         signal_dispatch();
-        r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
-        if (r) {
-            if (r == EINTR) continue;
-            suicide("clock_nanosleep: unexpected error: %s\n", strerror(r));
-        }
+        w = demand_enabled() ? demand_wait(&ts) : timer_wait(&ts);
+        if (w == WAKE_NONE)
+            continue;
 start:
-        if (gflags_debug) log_line("timeout: filling with entropy\n");
-        fill_entropy_amount(random_fd, max_bits, max_bits);
-        ts.tv_sec += refill_timeout;
+        if (gflags_debug) log_line("%s: filling with entropy\n", why[w]);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        fill_entropy_amount(max_bits, max_bits);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (demand_enabled())
+            demand_note_fill((double)(t1.tv_sec - t0.tv_sec)
+                             + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9);
+        if (w == WAKE_TIMER)
+            ts.tv_sec += refill_timeout;
+    }
+}
+
+/*
+ * With a raw output sink there is no kernel pool to pace us, so capture runs
+ * continuously and whitened output is written as fast as it is produced.
+ */
+static void output_loop(void)
+{
+    while (!sink_closed()) {
+        signal_dispatch();
+        get_random_data(rb_num_free(rb));
+        sink_drain(rb, rb_num_bytes(rb));
+    }
+}
+
+static void lock_all_if_realtime(void)
+{
+    if (rt_active()) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE))
+            suicide("mlockall failed\n");
+        rt_prefault();
     }
 }
 
+/*
+ * The capture process: opens the sound device, drops every privilege, and
+ * then fills the shared ring buffer whenever the feeder asks.  It dies with
+ * the feeder, and leaves terminal interrupts to the feeder, which stops it.
+ */
+static void capture_main(pid_t ppid, uid_t uid, gid_t gid)
+{
+    role = ROLE_CAPTURE;
+    signal(SIGINT, SIG_IGN);
+    sink_close();
+
+    sound_open();
+    if (use_agc)
+        agc_init(sound_mixer());
+    rt_enable();
+
+    arena_init(fips_arena_size() + vn_arena_size(workers), true);
+    fips_init();
+    vn_buf_init();
+
+    if (chroot_path)
+        nk_set_chroot(chroot_path);
+    nk_set_uidgid(uid, gid, NULL, 0);
+    /* Changing credentials clears the parent death signal, so set it now. */
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM))
+        suicide("prctl(PR_SET_PDEATHSIG) failed: %s\n", strerror(errno));
+    if (getppid() != ppid)
+        exit(EXIT_FAILURE);
+    lock_all_if_realtime();
+
+    vn_workers_start(workers);
+    record_start(vn_read_frames());
+
+    for (;;) {
+        vn_extractor_serve();
+        signal_dispatch();
+    }
+}
+
+/*
+ * The feeder process: keeps only CAP_SYS_ADMIN, and only credits the kernel.
+ * It just drains the ring buffer, so it stays out of the realtime class and
+ * does not compete with capture.
+ */
+static void feeder_main(unsigned max_bits, uid_t uid, gid_t gid)
+{
+    arena_init(sink_arena_size(), true);
+    sink_init();
+
+    if (chroot_path)
+        nk_set_chroot(chroot_path);
+    unsigned char keepcaps[] = { CAP_SYS_ADMIN };
+    nk_set_uidgid(uid, gid, keepcaps, sizeof keepcaps);
+
+    log_line("capturing in unprivileged process %d\n", (int)capture_pid);
+    vn_extractor_request();
+    main_loop(max_bits);
+}
+
+static bool set_transform(const char *name)
+{
+    for (int t = 0; t <= SNDEGD_XFORM_AUTO; ++t) {
+        if (!strcmp(name, sndegd_xform_name((enum sndegd_xform)t))) {
+            vn_set_transform((enum sndegd_xform)t);
+            return true;
+        }
+    }
+    log_line("unknown transform '%s'; use auto, raw, diff, or diff2\n", name);
+    return false;
+}
+
+/* Takes a percentage of one core, with or without a trailing '%'. */
+static bool set_cpu_budget(const char *str)
+{
+    char *end;
+    double pct = strtod(str, &end);
+    if (end == str || (*end && strcmp(end, "%")) || !(pct > 0.0 && pct <= 100.0)) {
+        log_line("cpu budget out of range: more than 0%% and at most 100%%\n");
+        return false;
+    }
+    vn_set_cpu_budget(pct / 100.0);
+    return true;
+}
+
 static void usage(void)
 {
     printf("Collect entropy from a sound card and feed it into the kernel random pool.\n"
            "Usage: snd-egd [options]\n\n");
     printf("--device          -d []  Sound device used (default %s)\n", DEFAULT_HW_DEVICE);
+    printf("--standby         -F []  Standby sound device to fail over to; repeatable.\n");
     printf("--item            -i []  Sound device item used (default %s)\n", DEFAULT_HW_ITEM);
+    printf("--agc             -g     Automatically adjust the item's capture gain.\n");
     printf("--sample-rate     -r []  Audio sampling rate. (default %i)\n", DEFAULT_SAMPLE_RATE);
     printf("--refill-time     -t []  Seconds between full refills (default %i)\n", DEFAULT_REFILL_SECS);
+    printf("--predict         -e     Also refill when the kernel wants entropy or a burst is forecast.\n");
+    printf("--output          -o []  Write whitened output to this file, or - for stdout.\n"
+           "--discard         -D     Discard whitened output; for benchmarking.\n");
+    printf("--record          -W []  Also save the raw captured audio to this WAV file.\n");
+    printf("--fips            -f     Drop output blocks that fail the FIPS 140-2 tests.\n");
+    printf("--transform       -T []  auto, raw, diff, or diff2 (default diff)\n");
+    printf("--toeplitz        -K []  Hash this many input bits per output bit instead.\n");
+    printf("--workers         -w []  Number of extraction threads (default 1)\n");
+    printf("--cpu-budget      -B []  Limit capture and extraction to this %% of one core.\n");
+    printf("--realtime        -R []  Capture with realtime scheduling at this priority.\n"
+           "--rt-policy       -P []  Realtime policy: fifo or rr (default fifo)\n"
+           "--cpus            -A []  Pin to these CPUs, e.g. 2 or 0,2-3\n");
     printf("--skip-bytes      -s []  Ignore first N audio bytes (default %i)\n", DEFAULT_SKIP_BYTES);
+    printf("--period-size     -p []  Capture period in frames (default %i)\n", DEFAULT_PERIOD_FRAMES);
+    printf("--buffer-size     -b []  Capture buffer in frames (default %i)\n", DEFAULT_BUFFER_FRAMES);
+    printf("--read-size       -m []  Frames read at a time (default one period)\n");
     printf("--user            -u []  User name or id to change to after dropping privileges.\n"
            "--chroot          -c []  Directory to use as the chroot jail.\n"
            "--syslog          -S     Log to syslog rather than stderr.\n"
@@ -279,16 +514,33 @@ static void copyright(void)
 
 int main(int argc, char **argv)
 {
-    int c, random_fd = -1;
+    int c;
     uid_t uid = 0;
-    gid_t gid;
+    gid_t gid = 0;
     bool have_uid = false;
     struct option long_options[] = {
         {"device",  1, NULL, 'd'},
+        {"standby", 1, NULL, 'F'},
         {"item", 1, NULL, 'i'},
+        {"agc", 0, NULL, 'g'},
         {"sample-rate", 1, NULL, 'r'},
         {"skip-bytes", 1, NULL, 's'},
+        {"period-size", 1, NULL, 'p'},
+        {"buffer-size", 1, NULL, 'b'},
+        {"read-size", 1, NULL, 'm'},
         {"refill-time", 1, NULL, 't'},
+        {"output", 1, NULL, 'o'},
+        {"discard", 0, NULL, 'D'},
+        {"fips", 0, NULL, 'f'},
+        {"transform", 1, NULL, 'T'},
+        {"toeplitz", 1, NULL, 'K'},
+        {"record", 1, NULL, 'W'},
+        {"workers", 1, NULL, 'w'},
+        {"cpu-budget", 1, NULL, 'B'},
+        {"predict", 0, NULL, 'e'},
+        {"realtime", 1, NULL, 'R'},
+        {"rt-policy", 1, NULL, 'P'},
+        {"cpus", 1, NULL, 'A'},
         {"user", 1, NULL, 'u'},
         {"chroot", 1, NULL, 'c'},
         {"syslog", 0, NULL, 'S'},
@@ -301,7 +553,7 @@ int main(int argc, char **argv)
     for (;;) {
         int t;
 
-        c = getopt_long(argc, argv, "d:i:r:s:t:u:c:Svh",
+        c = getopt_long(argc, argv, "d:F:i:gr:s:p:b:m:t:o:DfT:K:W:w:B:eR:P:A:u:c:Svh",
                         long_options, (int *)0);
         if (c == -1)
             break;
@@ -311,10 +563,18 @@ int main(int argc, char **argv)
                 sound_set_device(optarg);
                 break;
 
+            case 'F':
+                sound_set_standby(optarg);
+                break;
+
             case 'i':
                 sound_set_port(optarg);
                 break;
 
+            case 'g':
+                use_agc = true;
+                break;
+
             case 'r':
                 t = atoi(optarg);
                 sound_set_sample_rate(t);
@@ -325,12 +585,94 @@ int main(int argc, char **argv)
                 sound_set_skip_bytes(t);
                 break;
 
+            case 'p':
+                t = atoi(optarg);
+                if (t < 1 || t > MAX_PERIOD_FRAMES)
+                    log_line("period size out of range: 1 to %i frames; using default\n",
+                             MAX_PERIOD_FRAMES);
+                sound_set_period_size(t);
+                break;
+
+            case 'b':
+                t = atoi(optarg);
+                sound_set_buffer_size(t);
+                break;
+
+            case 'm':
+                t = atoi(optarg);
+                if (t > 0 && t <= MAX_READ_FRAMES) vn_set_read_size((unsigned)t);
+                else log_line("read size out of range: 1 to %i frames; using one period\n",
+                              MAX_READ_FRAMES);
+                break;
+
             case 't':
                 t = atoi(optarg);
                 if (t > 0 && t < 3600*24) refill_timeout = t;
                 else log_line("refill time out of range: 1s to 1d; using default 60s\n");
                 break;
 
+            case 'o':
+                sink_set_output(optarg);
+                break;
+
+            case 'D':
+                sink_set_null();
+                break;
+
+            case 'f':
+                fips_enable();
+                break;
+
+            case 'T':
+                if (!set_transform(optarg))
+                    exit(EXIT_FAILURE);
+                break;
+
+            case 'K':
+                t = atoi(optarg);
+                if (t >= TOEPLITZ_MIN_RATIO && t <= TOEPLITZ_MAX_RATIO)
+                    vn_set_toeplitz((unsigned)t);
+                else {
+                    log_line("toeplitz ratio out of range: %d to %d\n",
+                             TOEPLITZ_MIN_RATIO, TOEPLITZ_MAX_RATIO);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'W':
+                record_set_path(optarg);
+                break;
+
+            case 'w':
+                t = atoi(optarg);
+                if (t > 0 && t <= 32) workers = (unsigned)t;
+                else log_line("worker count out of range: 1 to 32; using default 1\n");
+                break;
+
+            case 'e':
+                demand_set_enabled(true);
+                break;
+
+            case 'B':
+                if (!set_cpu_budget(optarg))
+                    exit(EXIT_FAILURE);
+                break;
+
+            case 'R':
+                if (!rt_set_priority(atoi(optarg)))
+                    exit(EXIT_FAILURE);
+                break;
+
+            case 'P':
+                if (!rt_set_policy(optarg))
+                    exit(EXIT_FAILURE);
+                break;
+
+            case 'A':
+                if (!rt_set_cpus(optarg))
+                    exit(EXIT_FAILURE);
+                break;
+
             case 'u':
                 if (nk_uidgidbyname(optarg, &uid, &gid))
                     suicide("invalid user '%s' specified\n", optarg);
@@ -360,34 +702,82 @@ int main(int argc, char **argv)
 
     log_line("snd-egd starting up\n");
 
-    /* Open kernel random device */
-    random_fd = open(RANDOM_DEVICE, O_RDWR);
-    if (random_fd == -1)
-        suicide("Couldn't open random device: %s\n", strerror(errno));
+    /* Open kernel random device or the output file */
+    sink_open();
+    record_open();
 
     /* Find out the kernel entropy pool size */
-    unsigned max_bits = random_max_bits();
+    unsigned max_bits = sink_is_kernel() ? random_max_bits() : 0;
+    if (demand_enabled())
+        demand_init(max_bits);
 
     setup_signals();
 
+    if (sink_is_kernel() && have_uid) {
+        /*
+         * Fork before the sound device is opened, so that none of its state
+         * (or a sound server's threads) is ever in the privileged process.
+         */
+        static ring_buffer_t rb_private;
+        unsigned char *shm = arena_shared(ARENA_SIZE(sizeof(struct rb_index)) + RB_SIZE);
+        rb = &rb_private;
+        rb_init(rb, (struct rb_index *)(void *)shm,
+                shm + ARENA_SIZE(sizeof(struct rb_index)));
+        vn_extractor_init();
+        pid_t ppid = getpid();
+        capture_pid = fork();
+        if (capture_pid == -1)
+            suicide("fork failed: %s\n", strerror(errno));
+        if (capture_pid == 0) {
+            capture_main(ppid, uid, gid);
+            exit(EXIT_FAILURE);
+        }
+        role = ROLE_FEEDER;
+        feeder_main(max_bits, uid, gid);
+        exit(EXIT_FAILURE);
+    }
+
     sound_open();
+    if (use_agc)
+        agc_init(sound_mixer());
+    rt_enable();
+
+    /* Lock the entropy-bearing buffers while we are still privileged. */
+    arena_init(ARENA_SIZE(sizeof *rb) + ARENA_SIZE(sizeof(struct rb_index))
+               + ARENA_SIZE(RB_SIZE) + sink_arena_size()
+               + fips_arena_size() + vn_arena_size(workers), sink_is_kernel());
+    rb = arena_alloc(sizeof *rb);
+    rb_init(rb, arena_alloc(sizeof(struct rb_index)), arena_alloc(RB_SIZE));
+    sink_init();
+    fips_init();
+    vn_buf_init();
 
     if (chroot_path)
         nk_set_chroot(chroot_path);
+    /* Only crediting the kernel needs a capability. */
     unsigned char keepcaps[] = { CAP_SYS_ADMIN };
     if (have_uid)
-        nk_set_uidgid(uid, gid, keepcaps, sizeof keepcaps);
+        nk_set_uidgid(uid, gid, keepcaps,
+                      sink_is_kernel() ? sizeof keepcaps : 0);
+
+    /* In realtime mode, nothing on the capture path may page fault. */
+    lock_all_if_realtime();
 
-    if (mlockall(MCL_FUTURE))
-        suicide("mlockall failed\n");
+    vn_workers_start(workers);
+    record_start(vn_read_frames());
 
-    rb_init(&rb);
-    vn_buf_lock();
+    if (!sink_is_kernel()) {
+        vn_set_continuous(true);
+        output_loop();
+        exit_cleanup();
+    }
 
     /* Prefill entropy buffer */
-    get_random_data(rb.size - rb.bytes);
+    vn_extractor_init();
+    vn_extractor_start();
+    vn_extractor_request();
 
-    main_loop(random_fd, max_bits);
+    main_loop(max_bits);
 
     exit_cleanup();
     return 0;
@@ -4,16 +4,27 @@
 #define NJK_INCLUDE_SOUND_H_
 void sound_open(void);
 size_t sound_bytes_per_frame(void);
+size_t sound_period_frames(void);
+unsigned sound_sample_rate(void);
 unsigned sound_read(void *buf, size_t size);
+size_t sound_backlog(void);
+unsigned long sound_xruns(void);
+unsigned long sound_failovers(void);
+void sound_print_stats(void);
 void sound_start(void);
 void sound_stop(void);
 void sound_close(void);
+struct agc_mixer;
+const struct agc_mixer *sound_mixer(void);
 int sound_is_le(void);
 int sound_is_be(void);
 void sound_set_device(char *str);
+void sound_set_standby(char *str);
 void sound_set_port(char *str);
 void sound_set_sample_rate(int rate);
 void sound_set_skip_bytes(int sb);
+void sound_set_period_size(int frames);
+void sound_set_buffer_size(int frames);
 
 #endif
 
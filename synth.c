@@ -0,0 +1,364 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * Synthetic noise source.  Built instead of alsa.c with
+ * 'make SOUND_BACKEND=synth'.
+ *
+ * Generates stereo S16 PCM with known properties so that changes to the
+ * extractor can be measured repeatably without a sound card.  Output is a
+ * pure function of the parameters and the seed, and is produced as fast as
+ * it can be computed; there is no real-time pacing.
+ *
+ * Parameters are given as the device string, e.g.
+ *   -d sigma=300,corr=0.2,bias3=0.1,bits=14,seed=7
+ *
+ *   seed=N     PRNG seed (default 1)
+ *   sigma=X    standard deviation of the Gaussian noise, in LSBs (1000)
+ *   corr=X     lag-1 correlation of successive samples, 0 <= X < 1 (0)
+ *   dc=X       constant DC offset, in LSBs (0)
+ *   drift=X    DC drift in LSBs per second of sample time; the offset
+ *              sweeps back and forth across the full scale (0)
+ *   hum=X      amplitude of a 50 Hz tone common to both channels, in
+ *              LSBs, standing in for mains hum (0)
+ *   clip=X     samples are clipped to +/-X LSBs (32767)
+ *   bits=N     effective bit depth; the low 16-N bits are zero (16)
+ *   bias=X     every bit plane is forced to 1 with probability X (0)
+ *   biasN=X    bit plane N (0-15) is forced to 1 with probability X
+ *   gain=N     initial gain in percent, scales sigma (100); adjustable
+ *              through sound_mixer() so --agc can be exercised
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nk/log.h"
+#include "defines.h"
+#include "sound.h"
+#include "agc.h"
+
+extern bool gflags_debug;
+
+static char *params;
+static unsigned int sample_rate = DEFAULT_SAMPLE_RATE;
+static size_t period_frames = DEFAULT_PERIOD_FRAMES;
+
+static struct {
+    uint64_t seed;
+    double sigma, corr, dc, drift, hum, clip;
+    double bias[16];
+    unsigned bits;
+    long gain;
+} cfg = {
+    .seed = 1,
+    .sigma = 1000.0,
+    .clip = 32767.0,
+    .bits = 16,
+    .gain = 100,
+};
+
+static uint64_t rng[4];
+static double prev[2];
+static double offset, drift_step;
+static double hum_phase, hum_step;
+static double spare;
+static bool have_spare;
+static uint64_t bias_thresh[16];
+static uint16_t bias_planes, quant_mask;
+
+/* xoshiro256** */
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_next(void)
+{
+    uint64_t r = rotl(rng[1] * 5, 7) * 9;
+    uint64_t t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rotl(rng[3], 45);
+    return r;
+}
+
+static void rng_seed(uint64_t seed)
+{
+    /* splitmix64 */
+    for (size_t i = 0; i < 4; ++i) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        rng[i] = z ^ (z >> 31);
+    }
+}
+
+/* Standard normal deviate; Box-Muller, both halves used. */
+static inline double gauss(void)
+{
+    if (have_spare) {
+        have_spare = false;
+        return spare;
+    }
+    double u = ((double)(rng_next() >> 11) + 1.0) * 0x1.0p-53;
+    double v = (double)(rng_next() >> 11) * 0x1.0p-53;
+    double r = sqrt(-2.0 * log(u));
+    spare = r * sin(2.0 * M_PI * v);
+    have_spare = true;
+    return r * cos(2.0 * M_PI * v);
+}
+
+static double parse_double(const char *key, const char *val)
+{
+    char *end;
+    double d = strtod(val, &end);
+    if (end == val || *end)
+        suicide("synth: bad value '%s' for %s\n", val, key);
+    return d;
+}
+
+static void parse_params(void)
+{
+    char *save = NULL;
+
+    if (!params)
+        return;
+    for (char *tok = strtok_r(params, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (!val)
+            suicide("synth: expected key=value, got '%s'\n", tok);
+        *val++ = '\0';
+        if (!strcmp(tok, "seed"))
+            cfg.seed = strtoull(val, NULL, 0);
+        else if (!strcmp(tok, "sigma"))
+            cfg.sigma = parse_double(tok, val);
+        else if (!strcmp(tok, "corr"))
+            cfg.corr = parse_double(tok, val);
+        else if (!strcmp(tok, "dc"))
+            cfg.dc = parse_double(tok, val);
+        else if (!strcmp(tok, "drift"))
+            cfg.drift = parse_double(tok, val);
+        else if (!strcmp(tok, "hum"))
+            cfg.hum = parse_double(tok, val);
+        else if (!strcmp(tok, "clip"))
+            cfg.clip = parse_double(tok, val);
+        else if (!strcmp(tok, "bits"))
+            cfg.bits = (unsigned)atoi(val);
+        else if (!strcmp(tok, "gain"))
+            cfg.gain = atol(val);
+        else if (!strcmp(tok, "bias")) {
+            double b = parse_double(tok, val);
+            for (size_t j = 0; j < 16; ++j)
+                cfg.bias[j] = b;
+        } else if (!strncmp(tok, "bias", 4)) {
+            int j = atoi(tok + 4);
+            if (j < 0 || j > 15)
+                suicide("synth: no bit plane %s\n", tok + 4);
+            cfg.bias[j] = parse_double(tok, val);
+        } else
+            suicide("synth: unknown parameter '%s'\n", tok);
+    }
+    if (cfg.corr < 0.0 || cfg.corr >= 1.0)
+        suicide("synth: corr must be in [0, 1)\n");
+    if (cfg.bits < 1 || cfg.bits > 16)
+        suicide("synth: bits must be in [1, 16]\n");
+    if (cfg.clip > 32767.0 || cfg.clip < 0.0)
+        cfg.clip = 32767.0;
+    if (cfg.gain < 0 || cfg.gain > 100)
+        cfg.gain = 100;
+}
+
+void sound_open(void)
+{
+    parse_params();
+    rng_seed(cfg.seed);
+
+    quant_mask = (uint16_t)(0xffffu << (16 - cfg.bits));
+    for (size_t j = 0; j < 16; ++j) {
+        if (cfg.bias[j] <= 0.0)
+            continue;
+        bias_planes |= (uint16_t)(1u << j);
+        bias_thresh[j] = cfg.bias[j] >= 1.0 ? UINT64_MAX
+            : (uint64_t)(cfg.bias[j] * 0x1.0p64);
+    }
+    drift_step = cfg.drift / sample_rate;
+    hum_step = 2.0 * M_PI * 50.0 / sample_rate;
+
+    log_line("synthetic source: seed %llu, sigma %g, corr %g, dc %g, drift %g/s, hum %g, clip %g, %u bits\n",
+             (unsigned long long)cfg.seed, cfg.sigma, cfg.corr, cfg.dc,
+             cfg.drift, cfg.hum, cfg.clip, cfg.bits);
+}
+
+size_t sound_bytes_per_frame(void)
+{
+    return 2 * sizeof(int16_t);
+}
+
+size_t sound_period_frames(void)
+{
+    return period_frames;
+}
+
+unsigned sound_sample_rate(void)
+{
+    return sample_rate;
+}
+
+static inline int16_t synth_sample(size_t c, double sigma, double innov,
+                                   double common)
+{
+    double x = cfg.corr * prev[c] + innov * sigma * gauss();
+    prev[c] = x;
+    x += cfg.dc + offset + common;
+    x = MAX(MIN(x, cfg.clip), -cfg.clip - 1.0);
+    uint16_t s = (uint16_t)(int16_t)lrint(x);
+    s &= quant_mask;
+    for (uint16_t m = bias_planes; m; m &= (uint16_t)(m - 1)) {
+        int j = __builtin_ctz(m);
+        if (rng_next() < bias_thresh[j])
+            s |= (uint16_t)(1u << j);
+    }
+    return (int16_t)s;
+}
+
+unsigned sound_read(void *buf, size_t size)
+{
+    int16_t *out = buf;
+    size_t frames = size / sound_bytes_per_frame();
+    double sigma = cfg.sigma * (double)cfg.gain / 100.0;
+    /* Keeps the variance at sigma^2 regardless of the correlation. */
+    double innov = sqrt(1.0 - cfg.corr * cfg.corr);
+
+    for (size_t i = 0; i < frames; ++i) {
+        double common = cfg.hum ? cfg.hum * sin(hum_phase) : 0.0;
+        out[2 * i] = synth_sample(0, sigma, innov, common);
+        out[2 * i + 1] = synth_sample(1, sigma, innov, common);
+        hum_phase = fmod(hum_phase + hum_step, 2.0 * M_PI);
+        offset += drift_step;
+        if (offset > 32767.0 || offset < -32768.0)
+            drift_step = -drift_step;
+    }
+    return (unsigned)frames;
+}
+
+/* Frames are made on demand, so the reader is never behind. */
+size_t sound_backlog(void)
+{
+    return 0;
+}
+
+unsigned long sound_xruns(void)
+{
+    return 0;
+}
+
+unsigned long sound_failovers(void)
+{
+    return 0;
+}
+
+void sound_print_stats(void)
+{
+}
+
+void sound_start(void)
+{
+}
+
+void sound_stop(void)
+{
+}
+
+void sound_close(void)
+{
+}
+
+static bool synth_mixer_get_range(long *min, long *max)
+{
+    *min = 0;
+    *max = 100;
+    return true;
+}
+
+static bool synth_mixer_get(long *vol)
+{
+    *vol = cfg.gain;
+    return true;
+}
+
+static bool synth_mixer_set(long vol)
+{
+    cfg.gain = vol;
+    return true;
+}
+
+static const struct agc_mixer synth_mixer = {
+    .get_range = synth_mixer_get_range,
+    .get = synth_mixer_get,
+    .set = synth_mixer_set,
+};
+
+const struct agc_mixer *sound_mixer(void)
+{
+    return &synth_mixer;
+}
+
+int sound_is_le(void)
+{
+#ifdef HOST_ENDIAN_BE
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+int sound_is_be(void)
+{
+    return !sound_is_le();
+}
+
+void sound_set_device(char *str)
+{
+    params = strdup(str);
+}
+
+void sound_set_standby(char *str)
+{
+    log_line("synth: standby device %s ignored\n", str);
+}
+
+void sound_set_port(char *str)
+{
+    (void)str;
+}
+
+void sound_set_sample_rate(int rate)
+{
+    if (rate > 0)
+        sample_rate = (unsigned)rate;
+    else
+        sample_rate = DEFAULT_SAMPLE_RATE;
+}
+
+void sound_set_skip_bytes(int sb)
+{
+    (void)sb;
+}
+
+void sound_set_period_size(int frames)
+{
+    if (frames > 0 && frames <= MAX_PERIOD_FRAMES)
+        period_frames = (size_t)frames;
+    else
+        period_frames = DEFAULT_PERIOD_FRAMES;
+}
+
+void sound_set_buffer_size(int frames)
+{
+    (void)frames;
+}
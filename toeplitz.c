@@ -0,0 +1,244 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * Seeded Toeplitz hash extractor, an alternative to the von Neumann
+ * extractor for sources that are fast but whose bits are not independent.
+ *
+ * Each block of n = 256 * ratio input bits x is mapped to m = 256 output
+ * bits y = Tx, where T is the m-by-n Toeplitz matrix T[i][j] = s[n + i - j]
+ * over GF(2), defined by n + m - 1 bits of seed s.  Toeplitz matrices are a
+ * universal hash family, so by the leftover hash lemma the output is within
+ * 2^-(k - m)/2 of uniform whenever the block holds k bits of min-entropy;
+ * the ratio must therefore be chosen so that every input bit carries
+ * comfortably more than 1/ratio bits of min-entropy.  The seed need not be
+ * secret, but must be independent of the input.  It comes from getrandom(2)
+ * at startup without waiting for the kernel CRNG to be seeded, since at
+ * early boot snd-egd may be what seeds it; see toeplitz_init().
+ *
+ * Tx is the slice [n, n + m) of the carry-less product of x and s taken as
+ * polynomials, so it is computed a 64-bit word at a time with carry-less
+ * multiplies: PCLMULQDQ where the CPU has it, and a portable shift-and-xor
+ * multiply everywhere else.  toeplitz_init() checks both against a known
+ * answer before either is used.
+ */
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#ifndef GRND_INSECURE
+#define GRND_INSECURE 0x0004
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "nk/log.h"
+#include "defines.h"
+#include "toeplitz.h"
+
+typedef void (*toeplitz_fn)(const uint64_t *x, size_t nw, const uint64_t *s,
+                            uint64_t *y);
+
+static inline void clmul64(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+    uint64_t l = a & -(b & 1), h = 0;
+    for (unsigned i = 1; i < 64; ++i) {
+        uint64_t m = -(b >> i & 1);
+        l ^= (a << i) & m;
+        h ^= (a >> (64 - i)) & m;
+    }
+    *lo = l;
+    *hi = h;
+}
+
+/*
+ * Product word K collects x[i] * s[K - i] for every i; its low half lands in
+ * word K and its high half in word K + 1.  Word nw - 1 is only needed for
+ * the high half that it carries into word nw, the first output word.
+ */
+static void toeplitz_generic(const uint64_t *x, size_t nw, const uint64_t *s,
+                             uint64_t *y)
+{
+    uint64_t carry = 0;
+    for (size_t k = nw - 1; k < nw + TOEPLITZ_OUT_WORDS; ++k) {
+        uint64_t lo = 0, hi = 0;
+        for (size_t i = 0; i < nw; ++i) {
+            uint64_t l, h;
+            clmul64(x[i], s[k - i], &l, &h);
+            lo ^= l;
+            hi ^= h;
+        }
+        if (k >= nw)
+            y[k - nw] = lo ^ carry;
+        carry = hi;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2,pclmul")))
+static void toeplitz_pclmul(const uint64_t *x, size_t nw, const uint64_t *s,
+                            uint64_t *y)
+{
+    uint64_t carry = 0;
+    for (size_t k = nw - 1; k < nw + TOEPLITZ_OUT_WORDS; ++k) {
+        __m128i acc = _mm_setzero_si128();
+        for (size_t i = 0; i < nw; ++i) {
+            __m128i a = _mm_cvtsi64_si128((long long)x[i]);
+            __m128i b = _mm_cvtsi64_si128((long long)s[k - i]);
+            acc = _mm_xor_si128(acc, _mm_clmulepi64_si128(a, b, 0x00));
+        }
+        uint64_t lo = (uint64_t)_mm_cvtsi128_si64(acc);
+        uint64_t hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+        if (k >= nw)
+            y[k - nw] = lo ^ carry;
+        carry = hi;
+    }
+}
+#endif
+
+static toeplitz_fn hash = toeplitz_generic;
+
+bool toeplitz_accelerated(void)
+{
+    return hash != toeplitz_generic;
+}
+
+/* @return true if all of buf was filled by getrandom(2) with these flags */
+static bool seed_getrandom(void *buf, size_t len, unsigned flags)
+{
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t r = getrandom(p, len, flags);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+static void splitmix64_fill(uint64_t x, uint64_t *s, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        s[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * The public fallback seed: splitmix64 started from the first 64 bits of
+ * the fraction of pi.  It is as good as any other seed that does not
+ * depend on the input, but it is the same everywhere.
+ */
+static void seed_public(uint64_t *s, size_t n)
+{
+    splitmix64_fill(0x243f6a8885a308d3ull, s, n);
+}
+
+/*
+ * Tx at ratio 2 for the public seed and, as x, splitmix64 started from the
+ * first 64 bits of the fraction of e; worked out bit by bit from the
+ * definition of T.
+ */
+static const uint64_t kat_y[TOEPLITZ_OUT_WORDS] = {
+    0x348b428a00c9f1d1ull, 0x9a0a562d3b8a6746ull,
+    0xb233af535d7b9bf1ull, 0x651acf429e6a7b35ull,
+};
+
+/*
+ * Checks the selected multiply, and the portable one, against the known
+ * answer, and then against each other at the largest ratio, so that a
+ * miscompiled or misdetected PCLMULQDQ path never hashes real input.
+ */
+static void toeplitz_selftest(void)
+{
+    uint64_t x[TOEPLITZ_MAX_RATIO * TOEPLITZ_OUT_WORDS];
+    uint64_t s[(TOEPLITZ_MAX_RATIO + 1) * TOEPLITZ_OUT_WORDS];
+    uint64_t y[TOEPLITZ_OUT_WORDS], z[TOEPLITZ_OUT_WORDS];
+    size_t nw = 2 * TOEPLITZ_OUT_WORDS;
+
+    seed_public(s, nw + TOEPLITZ_OUT_WORDS);
+    splitmix64_fill(0xb7e151628aed2a6aull, x, nw);
+    toeplitz_generic(x, nw, s, y);
+    hash(x, nw, s, z);
+    if (memcmp(y, kat_y, sizeof y) || memcmp(z, kat_y, sizeof z))
+        suicide("toeplitz: self-test failed: wrong hash of the known input\n");
+    if (hash == toeplitz_generic)
+        return;
+
+    nw = TOEPLITZ_MAX_RATIO * TOEPLITZ_OUT_WORDS;
+    seed_public(s, nw + TOEPLITZ_OUT_WORDS);
+    splitmix64_fill(0xb7e151628aed2a6aull, x, nw);
+    toeplitz_generic(x, nw, s, y);
+    hash(x, nw, s, z);
+    if (memcmp(y, z, sizeof y))
+        suicide("toeplitz: self-test failed: pclmul and portable hashes differ\n");
+}
+
+/*
+ * The seed is read with GRND_NONBLOCK so that startup never waits for the
+ * CRNG.  If it is not ready, GRND_INSECURE (Linux 5.6) is used, and failing
+ * that, the public seed.
+ * @return where the seed came from
+ */
+const char *toeplitz_init(struct toeplitz *t, unsigned ratio)
+{
+    memset(t, 0, sizeof *t);
+    t->ratio = ratio;
+    t->in_words = (size_t)ratio * TOEPLITZ_OUT_WORDS;
+
+    const char *src = "getrandom";
+    size_t words = t->in_words + TOEPLITZ_OUT_WORDS;
+    if (!seed_getrandom(t->seed, words * sizeof t->seed[0], GRND_NONBLOCK)) {
+        if (errno != EAGAIN)
+            suicide("getrandom failed: %s\n", strerror(errno));
+        src = "getrandom, CRNG not yet ready";
+        if (!seed_getrandom(t->seed, words * sizeof t->seed[0], GRND_INSECURE)) {
+            src = "public, CRNG not yet ready";
+            seed_public(t->seed, words);
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul"))
+        hash = toeplitz_pclmul;
+#endif
+    toeplitz_selftest();
+    return src;
+}
+
+/*
+ * Collects input into blocks and hashes every full block into out, while
+ * there is room for its TOEPLITZ_OUT_BYTES.  A partial block is kept for
+ * the next call.
+ * @return bytes written to out; *used is set to the input bytes consumed
+ */
+size_t toeplitz_absorb(struct toeplitz *t, const void *in, size_t len,
+                       unsigned char *out, size_t cap, size_t *used)
+{
+    const unsigned char *src = in;
+    size_t block_bytes = t->in_words * sizeof t->block[0], done = 0, olen = 0;
+
+    while (done < len) {
+        size_t n = MIN(len - done, block_bytes - t->fill);
+        if (t->fill + n == block_bytes && cap - olen < TOEPLITZ_OUT_BYTES)
+            break;
+        memcpy((unsigned char *)t->block + t->fill, src + done, n);
+        t->fill += n;
+        done += n;
+        if (t->fill < block_bytes)
+            break;
+        uint64_t y[TOEPLITZ_OUT_WORDS];
+        hash(t->block, t->in_words, t->seed, y);
+        memcpy(out + olen, y, sizeof y);
+        olen += sizeof y;
+        t->fill = 0;
+        ++t->blocks;
+    }
+    *used = done;
+    return olen;
+}
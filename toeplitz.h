@@ -0,0 +1,28 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_TOEPLITZ_H_
+#define NJK_TOEPLITZ_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each block of TOEPLITZ_OUT_BYTES * ratio input bytes yields this many. */
+#define TOEPLITZ_OUT_BYTES 32
+#define TOEPLITZ_OUT_WORDS (TOEPLITZ_OUT_BYTES / 8)
+#define TOEPLITZ_MIN_RATIO 2
+#define TOEPLITZ_MAX_RATIO 64
+
+struct toeplitz {
+    unsigned ratio;
+    size_t in_words, fill;
+    unsigned long long blocks;
+    uint64_t seed[(TOEPLITZ_MAX_RATIO + 1) * TOEPLITZ_OUT_WORDS];
+    uint64_t block[TOEPLITZ_MAX_RATIO * TOEPLITZ_OUT_WORDS];
+};
+
+const char *toeplitz_init(struct toeplitz *t, unsigned ratio);
+size_t toeplitz_absorb(struct toeplitz *t, const void *in, size_t len,
+                       unsigned char *out, size_t cap, size_t *used);
+bool toeplitz_accelerated(void);
+
+#endif
@@ -0,0 +1,126 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+/*
+ * Flight recorder: the last TRACE_SLOTS events of interest, kept in memory
+ * so that an incident can be reconstructed after the fact without having
+ * run in verbose mode.  It is dumped as text along with the statistics.
+ *
+ * Any thread may record.  A writer claims a slot by bumping 'head', then
+ * publishes the slot like a seqlock: it zeroes the slot's tag, stores the
+ * payload, and stores the tag, which is the claimed position and the event
+ * type, with release ordering.  A reader copies a slot and keeps it only if
+ * the tag is nonzero and unchanged across the copy, so a slot that is being
+ * overwritten is skipped rather than torn.  Recording never blocks and costs
+ * one atomic add, one clock read, and four stores.
+ *
+ * Only counts and times are recorded, never anything derived from samples.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "nk/log.h"
+#include "trace.h"
+
+extern bool gflags_debug;
+
+#define TRACE_SLOTS 4096 /* must be a power of two */
+
+_Static_assert((TRACE_SLOTS & (TRACE_SLOTS - 1)) == 0,
+               "TRACE_SLOTS must be a power of two");
+
+struct trace_slot {
+    _Atomic uint64_t tag; /* (position + 1) << 8 | event; 0 while written */
+    _Atomic uint64_t ns;
+    _Atomic uint64_t ab, cd;
+};
+
+static struct trace_slot slots[TRACE_SLOTS];
+static _Atomic uint64_t head;
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void trace_event(enum trace_event ev, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    uint64_t pos = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    struct trace_slot *s = &slots[pos & (TRACE_SLOTS - 1)];
+
+    atomic_store_explicit(&s->tag, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&s->ns, trace_now(), memory_order_relaxed);
+    atomic_store_explicit(&s->ab, (uint64_t)a | (uint64_t)b << 32, memory_order_relaxed);
+    atomic_store_explicit(&s->cd, (uint64_t)c | (uint64_t)d << 32, memory_order_relaxed);
+    atomic_store_explicit(&s->tag, (pos + 1) << 8 | (uint64_t)ev, memory_order_release);
+}
+
+static void print_event(uint64_t ns, unsigned ev, uint32_t a, uint32_t b,
+                        uint32_t c, uint32_t d)
+{
+    unsigned long long sec = ns / 1000000000u, usec = ns % 1000000000u / 1000u;
+
+    switch (ev) {
+    case TRACE_REFILL:
+        log_line("%llu.%06llu refill: want %u bytes, ring %u\n", sec, usec, a, b);
+        break;
+    case TRACE_REFILLED:
+        log_line("%llu.%06llu refilled: in %u, out %u, eff %.3f, ring %u, xruns %u\n",
+                 sec, usec, a, b, a ? (double)b / (double)a : 0.0, c, d);
+        break;
+    case TRACE_XRUN:
+        log_line("%llu.%06llu xrun: %u total\n", sec, usec, a);
+        break;
+    case TRACE_THROTTLE:
+        log_line("%llu.%06llu cpu budget: paused %uus\n", sec, usec, a);
+        break;
+    case TRACE_FAILOVER:
+        log_line("%llu.%06llu failover: to device %u, %u total\n", sec, usec, a, b);
+        break;
+    case TRACE_CREDIT:
+        log_line("%llu.%06llu credit: %u bytes in %uns, ring %u\n", sec, usec, a, b, c);
+        break;
+    case TRACE_WAIT:
+        log_line("%llu.%06llu waited for extractor: %uus\n", sec, usec, a);
+        break;
+    case TRACE_SIGNAL:
+        log_line("%llu.%06llu signal: %s\n", sec, usec, strsignal((int)a));
+        break;
+    default:
+        log_line("%llu.%06llu event %u: %u %u %u %u\n", sec, usec, ev, a, b, c, d);
+        break;
+    }
+}
+
+/* Prints the recorded events, oldest first, with CLOCK_MONOTONIC times. */
+void trace_dump(void)
+{
+    if (!gflags_debug)
+        return;
+    uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+    uint64_t pos = end > TRACE_SLOTS ? end - TRACE_SLOTS : 0;
+    unsigned long skipped = 0;
+
+    log_line("flight recorder: %llu events, last %llu:\n",
+             (unsigned long long)end, (unsigned long long)(end - pos));
+    for (; pos < end; ++pos) {
+        struct trace_slot *s = &slots[pos & (TRACE_SLOTS - 1)];
+        uint64_t tag = atomic_load_explicit(&s->tag, memory_order_acquire);
+        uint64_t ns = atomic_load_explicit(&s->ns, memory_order_relaxed);
+        uint64_t ab = atomic_load_explicit(&s->ab, memory_order_relaxed);
+        uint64_t cd = atomic_load_explicit(&s->cd, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (tag >> 8 != pos + 1 || atomic_load_explicit(&s->tag, memory_order_relaxed) != tag) {
+            ++skipped;
+            continue;
+        }
+        print_event(ns, (unsigned)(tag & 0xff), (uint32_t)ab, (uint32_t)(ab >> 32),
+                    (uint32_t)cd, (uint32_t)(cd >> 32));
+    }
+    if (skipped)
+        log_line("flight recorder: %lu events were being overwritten\n", skipped);
+}
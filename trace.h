@@ -0,0 +1,22 @@
+// Copyright 2026 Nicholas J. Kain <njkain at gmail dot com>
+// SPDX-License-Identifier: MIT
+#ifndef NJK_TRACE_H_
+#define NJK_TRACE_H_
+#include <stdint.h>
+
+enum trace_event {
+    TRACE_REFILL = 1,   /* target bytes, ring fill */
+    TRACE_REFILLED,     /* bytes in, bytes out, ring fill, xruns */
+    TRACE_XRUN,         /* total xruns */
+    TRACE_THROTTLE,     /* microseconds paused */
+    TRACE_FAILOVER,     /* device index, total failovers */
+    TRACE_CREDIT,       /* bytes, ioctl nanoseconds, ring fill */
+    TRACE_WAIT,         /* microseconds waited for the extractor */
+    TRACE_SIGNAL,       /* signal number */
+};
+
+uint64_t trace_now(void);
+void trace_event(enum trace_event ev, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void trace_dump(void);
+
+#endif